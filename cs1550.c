@@ -1,6 +1,7 @@
 /*
-Create ".disk" file:
-dd bs=1K count=5K if=/dev/zero of=.disk
+Create and format the ".disk" file (-s size, -b block size, -B bitmap at the start or end):
+gcc -o mkfs.cs1550 mkfs.cs1550.c
+./mkfs.cs1550 -s 5M -b 4096 .disk
 
 COMPILE:
 make
@@ -11,6 +12,10 @@ RUN:Inside THOTH
 RUN:Outside THOTH
 ./cs1550 testmount
 
+DEBUG TRACING:
+Build with -DCS1550_DEBUG to compile in the debug log lines, then mount with
+./cs1550 -d -o log_level=3 testmount
+
 UNMOUNT:
 fusermount -u testmount
 */
@@ -18,185 +23,1354 @@ fusermount -u testmount
 #define	FUSE_USE_VERSION 26
 
 #include <fuse.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "cs1550.h"
 
-//we'll use 8.3 filenames
-#define	MAX_FILENAME 8
-#define	MAX_EXTENSION 3
+static const char * DISK_FILE_NAME = ".disk";
 
-//How many files can there be in one directory?
-#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+// The .disk image is opened and mapped once at mount (cs1550_init) and
+// released at unmount (cs1550_destroy). Every handler works on pointers into
+// disk_map, so metadata operations cost no syscalls at all.
+static char disk_path[PATH_MAX]; // Absolute path, resolved before fuse_main daemonizes
+static int disk_fd = -1;
+static char * disk_map = NULL;
+static size_t disk_length = 0;
+static int disk_dirty = 0; // Set on every store into the mapping, cleared by msync
+
+// Copy of the superblock, read at mount. Everything sized in blocks goes by it
+static superblock geometry;
+#define BLOCK_SIZE (geometry.nBlockSize)
+
+// Mount options the filesystem understands itself (-o name=value), the rest
+// go on to fuse_main
+struct cs1550_config {
+	int cacheBlocks;	// cache_blocks: size of the block cache, 0 for DEFAULT_CACHE_BYTES worth
+	int logLevel;		// log_level: 0 errors, 1 warnings, 2 info, 3 debug
+};
 
-// Outlines the disk and blocks
-#define DISK_SIZE 5242880 // 5242880 Bytes = 5 MB
-#define	BLOCK_SIZE 512
-#define BIT_MAP_SIZE 1280 // Thx Piazza
-static const char * DISK_FILE_NAME = ".disk";
+// =========== LOGGING ==============
+// LOG_DEBUG compiles to nothing unless built with -DCS1550_DEBUG, so the
+// per-block and per-entry tracing costs nothing in a normal build. The other
+// levels are checked against -o log_level at runtime. Lines are formatted by
+// the caller into a ring buffer and a background thread writes them out, so a
+// busy mount never waits on stdout. When the ring is full lines are dropped
+// (and counted) rather than blocking the handler.
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+static struct cs1550_config config = { 0, LOG_LEVEL_WARN };
+
+#define LOG(level, ...) do { if ((level) <= config.logLevel) { log_write(__VA_ARGS__); } } while (0)
+#define LOG_ERROR(...) LOG(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LOG_LEVEL_INFO, __VA_ARGS__)
+#ifdef CS1550_DEBUG
+#define LOG_DEBUG(...) LOG(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do { } while (0)
+#endif
+
+#define LOG_LINE_SIZE 256
+#define LOG_RING_LINES 1024
+
+struct log_ring {
+	char lines[LOG_RING_LINES][LOG_LINE_SIZE];
+	unsigned long head;		// Next line to fill
+	unsigned long tail;		// Next line to write out
+	unsigned long dropped;	// Lines lost because the ring was full
+	int running;			// The writer thread is up
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
 
-// Number of blocks that can fit into the disk minus the tracking bitmap
-#define BLOCK_COUNT (DISK_SIZE / BLOCK_SIZE - ((DISK_SIZE - 1) / (sizeof(long) * BLOCK_SIZE * BLOCK_SIZE) + 1))
+static struct log_ring log_ring = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static void log_write(const char * format, ...) {
+	char line[LOG_LINE_SIZE];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(line, sizeof(line) - 1, format, args);
+	va_end(args);
+	if (len < 0) { return; }
+	if (len > (int) sizeof(line) - 2) { len = sizeof(line) - 2; }
+	line[len] = '\n';
+	line[len + 1] = '\0';
+	pthread_mutex_lock(&log_ring.lock);
+	if (!log_ring.running) { // Before mount or after unmount, just write it
+		fputs(line, stderr);
+	} else if (log_ring.head - log_ring.tail == LOG_RING_LINES) {
+		log_ring.dropped++;
+	} else {
+		memcpy(log_ring.lines[log_ring.head % LOG_RING_LINES], line, len + 2);
+		if (log_ring.head++ == log_ring.tail) { pthread_cond_signal(&log_ring.wake); }
+	}
+	pthread_mutex_unlock(&log_ring.lock);
+}
 
-//How much data can one block hold?
-#define	MAX_DATA_IN_BLOCK (BLOCK_SIZE)
-#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+// Writes out everything queued so far in one batch. Slots between tail and
+// head can't be reused until tail moves, so they are read without the lock
+static void * log_writer(void * arg) {
+	(void) arg;
+	pthread_mutex_lock(&log_ring.lock);
+	while (log_ring.running || log_ring.tail != log_ring.head) {
+		if (log_ring.tail == log_ring.head) {
+			pthread_cond_wait(&log_ring.wake, &log_ring.lock);
+			continue;
+		}
+		unsigned long head = log_ring.head;
+		unsigned long dropped = log_ring.dropped;
+		log_ring.dropped = 0;
+		pthread_mutex_unlock(&log_ring.lock);
+		unsigned long i;
+		for (i = log_ring.tail; i != head; i++) { fputs(log_ring.lines[i % LOG_RING_LINES], stdout); }
+		if (dropped > 0) { printf("(%lu log lines dropped)\n", dropped); }
+		fflush(stdout);
+		pthread_mutex_lock(&log_ring.lock);
+		log_ring.tail = head;
+	}
+	pthread_mutex_unlock(&log_ring.lock);
+	return NULL;
+}
 
-// Used in bitmap management
-#define ROOT_BIT_OFFSET 1
-#define BITMAP_BIT_OFFSET 3 // The blocks where the bitmaps are stored
+static void log_start() {
+	pthread_mutex_lock(&log_ring.lock);
+	log_ring.running = pthread_create(&log_ring.writer, NULL, log_writer, NULL) == 0;
+	pthread_mutex_unlock(&log_ring.lock);
+}
 
-//The attribute packed means to not align these things
-struct cs1550_directory_entry
-{
-	int nFiles;	//How many files are in this directory.
-				//Needs to be less than MAX_FILES_IN_DIR
-
-	struct cs1550_file_directory
-	{
-		char fname[MAX_FILENAME + 1];	//filename (plus space for nul)
-		char fext[MAX_EXTENSION + 1];	//extension (plus space for nul)
-		size_t fsize;					//file size
-		long nStartBlock;				//where the first block is on disk
-	} __attribute__((packed)) files[MAX_FILES_IN_DIR];	//There is an array of these
-
-	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.
-	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
-} ;
-
-struct cs1550_root_directory
-{
-	int nDirectories;	//How many subdirectories are in the root
-						//Needs to be less than MAX_DIRS_IN_ROOT
-	struct cs1550_directory
-	{
-		char dname[MAX_FILENAME + 1];	//directory name (plus space for nul)
-		long nStartBlock;				//where the directory block is on disk
-	} __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];	//There is an array of these
-
-	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.
-	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
-} ;
-
-// typedef renames the directory to the second argument
-typedef struct cs1550_directory_entry directory_entry;
-typedef struct cs1550_root_directory root_directory;
-
-struct cs1550_disk_block
-{
-	// Each block has data
-	char data[MAX_DATA_IN_BLOCK];
+// Drains whatever is still queued before returning
+static void log_stop() {
+	pthread_mutex_lock(&log_ring.lock);
+	int running = log_ring.running;
+	log_ring.running = 0;
+	pthread_cond_signal(&log_ring.wake);
+	pthread_mutex_unlock(&log_ring.lock);
+	if (running) { pthread_join(log_ring.writer, NULL); }
+}
+
+// =========== BLOCK CACHE ==============
+// Sits between the handlers and the mapped image. A miss copies the block in
+// from the mapping and it stays here until evicted. write_to_disk only marks
+// a block dirty, so repeated updates to the same block are coalesced into a
+// single copy back at flush, fsync or eviction. A block is only copied back
+// while nobody can be changing it: eviction only takes unpinned blocks, and
+// flush_metadata holds root_lock exclusively, which keeps out every handler
+// that changes metadata. Root and directory blocks are flagged
+// resident and are only evicted when nothing else can be. cache.lock guards
+// the index, the LRU list and the flags; the bytes of a block are guarded by
+// the root or directory lock of whatever owns it. When every slot is pinned
+// get_disk_block waits for one to be released instead of failing.
+// A handler pins at most 3 blocks at once (directory, extent block, new
+// extent block) and FUSE 2 runs at most 10 worker threads, so with this many
+// slots there is always one to wait for and the wait can't deadlock
+#define MIN_CACHE_BLOCKS 48
+// Blocks can be up to a megabyte, so the cache is sized in bytes by default
+// and -o cache_blocks can't ask for more than MAX_CACHE_BYTES
+#define DEFAULT_CACHE_BYTES (1024 * 1024)
+#define MAX_CACHE_BYTES (1024L * 1024 * 1024)
+
+struct cache_entry {
+	long blockNum;					// -1 while the slot is unused
+	int dirty;						// Newer than the copy in the image
+	int pins;						// How many handlers are holding the block
+	int resident;					// Hot metadata, evicted last
+	struct cache_entry * hashNext;	// Chain in the block number index
+	struct cache_entry * prev;		// LRU list, most recently used at the head
+	struct cache_entry * next;
 };
 
-typedef struct cs1550_disk_block disk_block;
-// Create a bitmap to keep track of open/free block
+struct block_cache {
+	int nBlocks;
+	int nBuckets;					// Always a power of two
+	char * data;					// Slot i lives at data + i * BLOCK_SIZE
+	struct cache_entry * entries;
+	struct cache_entry ** buckets;
+	struct cache_entry * head;
+	struct cache_entry * tail;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long writebacks;
+	unsigned long waits;			// Times a handler found every slot pinned
+	pthread_mutex_t lock;
+	pthread_cond_t released;		// Signalled when a block's last pin goes
+};
 
-// There are a total of 512b maximum for the bit map
-// The LAST BLOCKS should contain the bit map
+static struct block_cache cache;
 
-// DATA BLOCK
-	// Type 1: Root directory
-		// - Stored at the first block in disk
-		// - Bitmap should always be TAKEN (1) for block 0
-	// Type 2: Subdirectory (directory_entry)
-	// Type 3: File (file_directory)
-		// - When type 2 or 3 created, check bitmap for a FREE (0) block
-		// - Then add it to the disk and set the bitmap to 1 for that block
+static struct cache_entry ** cache_bucket(long blockNum) {
+	return &cache.buckets[((unsigned long) blockNum * 2654435761UL) & (cache.nBuckets - 1)];
+}
 
-// =========== HELP FUNCTIONS ==============
-static void * get_disk_block(long blockNum, FILE * disk) {
-	void * block = malloc(BLOCK_SIZE);
-	// From the beginning of the disk (SEEK_SET) seek to the correct block num on the disk
-	fseek(disk, blockNum * BLOCK_SIZE, SEEK_SET);
-	// Read into the block the entire block
-	fread(block, BLOCK_SIZE, 1, disk);
-	return block;
+static char * cache_data(struct cache_entry * entry) {
+	return cache.data + (entry - cache.entries) * BLOCK_SIZE;
 }
 
-static root_directory * get_root_directory(FILE * disk) {
-	return (root_directory *) get_disk_block(0, disk);
+static struct cache_entry * cache_lookup(long blockNum) {
+	struct cache_entry * entry = *cache_bucket(blockNum);
+	while (entry != NULL && entry->blockNum != blockNum) { entry = entry->hashNext; }
+	return entry;
 }
 
-static directory_entry * get_directory(long blockNum, FILE * disk) {
-	return (directory_entry *) get_disk_block(blockNum, disk);
+static void cache_unhash(struct cache_entry * entry) {
+	struct cache_entry ** link = cache_bucket(entry->blockNum);
+	while (*link != entry) { link = &(*link)->hashNext; }
+	*link = entry->hashNext;
+	entry->hashNext = NULL;
 }
 
-static void write_to_disk(void * block, long blockNum, FILE * disk) {
-	fseek(disk, blockNum * BLOCK_SIZE, SEEK_SET);
-	fwrite(block, BLOCK_SIZE, 1, disk);
+// Moves the entry to the head of the LRU list
+static void cache_touch(struct cache_entry * entry) {
+	if (cache.head == entry) { return; }
+	// Unlink
+	if (entry->prev != NULL) { entry->prev->next = entry->next; }
+	if (entry->next != NULL) { entry->next->prev = entry->prev; }
+	if (cache.tail == entry) { cache.tail = entry->prev; }
+	// Relink at the head
+	entry->prev = NULL;
+	entry->next = cache.head;
+	if (cache.head != NULL) { cache.head->prev = entry; }
+	cache.head = entry;
+	if (cache.tail == NULL) { cache.tail = entry; }
 }
 
-static directory_entry * get_directory_from_root(char * directoryName, long * dirBlock) {
-	*dirBlock = 0;
-	FILE * disk = fopen(DISK_FILE_NAME, "rb+");
-	root_directory * root = get_root_directory(disk);
-	directory_entry * dir = NULL;
+static void cache_writeback(struct cache_entry * entry) {
+	memcpy(disk_map + entry->blockNum * BLOCK_SIZE, cache_data(entry), BLOCK_SIZE);
+	entry->dirty = 0;
+	__atomic_store_n(&disk_dirty, 1, __ATOMIC_RELAXED);
+	cache.writebacks++;
+}
+
+// Least recently used unpinned block, preferring anything that isn't hot metadata
+static struct cache_entry * cache_victim() {
+	struct cache_entry * entry;
+	for (entry = cache.tail; entry != NULL; entry = entry->prev) {
+		if (entry->pins == 0 && !entry->resident) { return entry; }
+	}
+	for (entry = cache.tail; entry != NULL; entry = entry->prev) {
+		if (entry->pins == 0) { return entry; }
+	}
+	return NULL;
+}
+
+static int cache_init(int nBlocks) {
+	int i;
+	if (nBlocks == 0) { nBlocks = DEFAULT_CACHE_BYTES / BLOCK_SIZE; }
+	if (nBlocks > MAX_CACHE_BYTES / BLOCK_SIZE) { nBlocks = MAX_CACHE_BYTES / BLOCK_SIZE; }
+	if (nBlocks < MIN_CACHE_BLOCKS) { nBlocks = MIN_CACHE_BLOCKS; }
+	memset(&cache, 0, sizeof(cache));
+	cache.nBlocks = nBlocks;
+	cache.nBuckets = 1;
+	while (cache.nBuckets < nBlocks * 2) { cache.nBuckets <<= 1; }
+	cache.data = malloc((size_t) nBlocks * BLOCK_SIZE);
+	cache.entries = calloc(nBlocks, sizeof(struct cache_entry));
+	cache.buckets = calloc(cache.nBuckets, sizeof(struct cache_entry *));
+	pthread_mutex_init(&cache.lock, NULL);
+	pthread_cond_init(&cache.released, NULL);
+	if (cache.data == NULL || cache.entries == NULL || cache.buckets == NULL) { return -ENOMEM; }
+	for (i = 0; i < nBlocks; i++) {
+		cache.entries[i].blockNum = -1;
+		cache_touch(&cache.entries[i]);
+	}
+	return 0;
+}
+
+// Copies every dirty block back into the image. Only safe when no handler
+// can be halfway through changing a block (see flush_metadata)
+static void cache_flush() {
 	int i;
-	for (i = 0; i < root->nDirectories; i++) {
-		if (strcmp(root->directories[i].dname, directoryName) == 0) {
-			// printf("The directory %s is at block %ld\n", root->directories[i].dname, root->directories[i].nStartBlock);
-			*dirBlock = root->directories[i].nStartBlock;
+	pthread_mutex_lock(&cache.lock);
+	for (i = 0; i < cache.nBlocks; i++) {
+		if (cache.entries[i].dirty) { cache_writeback(&cache.entries[i]); }
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+static void cache_destroy() {
+	cache_flush();
+	free(cache.data);
+	free(cache.entries);
+	free(cache.buckets);
+	pthread_mutex_destroy(&cache.lock);
+	pthread_cond_destroy(&cache.released);
+	memset(&cache, 0, sizeof(cache));
+}
+
+// =========== FREE SPACE BITMAP ==============
+// The on-disk bitmap is loaded into RAM at mount as 64-bit words (bit b of
+// byte k on disk is block k * 8 + b, which is exactly a little-endian word).
+// Allocation scans a word at a time from a rotating next-fit hint, and only
+// the words that changed are copied back, in runs, at flush/fsync/unmount.
+// Words, dirty bits and the free count are only touched with atomics, so
+// threads allocate and free blocks without taking any lock.
+struct free_bitmap {
+	uint64_t * words;
+	uint64_t * dirty;	// One bit per word that differs from the image
+	long nWords;
+	long nBlocks;		// Blocks the bitmap can hand out or reserve
+	long nFree;			// Kept up to date on every allocation
+	long hint;			// Word the next search starts at
+};
+
+static struct free_bitmap bitmap;
+
+static char * bitmap_on_disk() {
+	return disk_map + geometry.nBitmapStart * BLOCK_SIZE;
+}
+
+static void bitmap_mark_dirty(long word) {
+	__atomic_fetch_or(&bitmap.dirty[word / 64], 1ULL << (word % 64), __ATOMIC_RELEASE);
+}
+
+// Sets a block's bit. Returns 1 if this call took the block, 0 if it was already used
+static int bitmap_reserve(long blockNum) {
+	uint64_t mask = 1ULL << (blockNum % 64);
+	uint64_t old = __atomic_fetch_or(&bitmap.words[blockNum / 64], mask, __ATOMIC_ACQ_REL);
+	if (old & mask) { return 0; }
+	bitmap_mark_dirty(blockNum / 64);
+	return 1;
+}
+
+static int bitmap_is_free(long blockNum) {
+	return !(__atomic_load_n(&bitmap.words[blockNum / 64], __ATOMIC_ACQUIRE) & (1ULL << (blockNum % 64)));
+}
+
+// Takes up to n free blocks that directly follow start, stopping at the first used one
+static long bitmap_claim_following(long start, long n) {
+	long got = 0;
+	while (got < n && start + got < bitmap.nBlocks && bitmap_reserve(start + got)) { got++; }
+	__atomic_sub_fetch(&bitmap.nFree, got, __ATOMIC_RELAXED);
+	return got;
+}
+
+static void bitmap_free_run(long start, long n) {
+	long i;
+	for (i = start; i < start + n; i++) {
+		__atomic_fetch_and(&bitmap.words[i / 64], ~(1ULL << (i % 64)), __ATOMIC_ACQ_REL);
+		bitmap_mark_dirty(i / 64);
+	}
+	__atomic_add_fetch(&bitmap.nFree, n, __ATOMIC_RELAXED);
+}
+
+static int bitmap_load() {
+	long i;
+	bitmap.nBlocks = geometry.nBlocks;
+	bitmap.nWords = (bitmap.nBlocks + 63) / 64;
+	bitmap.words = calloc(bitmap.nWords, sizeof(uint64_t));
+	bitmap.dirty = calloc((bitmap.nWords + 63) / 64, sizeof(uint64_t));
+	if (bitmap.words == NULL || bitmap.dirty == NULL) { return -ENOMEM; }
+	memcpy(bitmap.words, bitmap_on_disk(), (bitmap.nBlocks + 7) / 8);
+	for (i = 0; i < bitmap.nWords; i++) { bitmap.words[i] = le64toh(bitmap.words[i]); }
+	// Bits past the last block in the final word can never be handed out
+	if (bitmap.nBlocks % 64 != 0) { bitmap.words[bitmap.nWords - 1] |= ~0ULL << (bitmap.nBlocks % 64); }
+	// The superblock, the root and the blocks holding the bitmap itself are always taken
+	bitmap_reserve(0);
+	bitmap_reserve(geometry.nRootBlock);
+	for (i = 0; i < geometry.nBitmapBlocks; i++) { bitmap_reserve(geometry.nBitmapStart + i); }
+	bitmap.nFree = 0;
+	for (i = 0; i < bitmap.nWords; i++) { bitmap.nFree += 64 - __builtin_popcountll(bitmap.words[i]); }
+	bitmap.hint = 0;
+	return 0;
+}
+
+// Copies the words that changed since the last flush back into the image
+static void bitmap_flush() {
+	long group;
+	size_t diskBytes = (bitmap.nBlocks + 7) / 8;
+	for (group = 0; group < (bitmap.nWords + 63) / 64; group++) {
+		// Words changed after this point are marked dirty again for the next flush
+		uint64_t dirty = __atomic_exchange_n(&bitmap.dirty[group], 0, __ATOMIC_ACQ_REL);
+		while (dirty != 0) { // Skips 64 clean words at a time
+			long word = group * 64 + __builtin_ctzll(dirty);
+			uint64_t le = htole64(__atomic_load_n(&bitmap.words[word], __ATOMIC_ACQUIRE));
+			// The last word may hang past the end of the on-disk bitmap
+			size_t bytes = (size_t) (word + 1) * 8 > diskBytes ? diskBytes - word * 8 : 8;
+			memcpy(bitmap_on_disk() + word * 8, &le, bytes);
+			dirty &= dirty - 1;
+			__atomic_store_n(&disk_dirty, 1, __ATOMIC_RELAXED);
 		}
 	}
-	if (*dirBlock != 0) { dir = get_directory(*dirBlock, disk); }
-	free(root);
-	fclose(disk);
+}
+
+static void bitmap_destroy() {
+	bitmap_flush();
+	free(bitmap.words);
+	free(bitmap.dirty);
+	memset(&bitmap, 0, sizeof(bitmap));
+}
+
+// =========== LOCKING ==============
+// FUSE runs handlers on many threads at once. Locks are always taken in the
+// order root_lock, one directory lock, then cache.lock; the bitmap needs none.
+// Everything except mkdir holds root_lock shared, so path lookups through the
+// root never wait on each other.
+static pthread_rwlock_t root_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Directory blocks hash onto a fixed table of locks, so nothing has to be
+// created or freed along with a directory. Readers (getattr, readdir, read)
+// share a directory, anything that changes its block or a file in it doesn't
+#define DIR_LOCKS 64
+static pthread_rwlock_t dir_locks[DIR_LOCKS];
+
+static void locks_init() {
+	int i;
+	for (i = 0; i < DIR_LOCKS; i++) { pthread_rwlock_init(&dir_locks[i], NULL); }
+}
+
+static void lock_directory(long dirBlock, int exclusive) {
+	if (exclusive) {
+		pthread_rwlock_wrlock(&dir_locks[dirBlock % DIR_LOCKS]);
+	} else {
+		pthread_rwlock_rdlock(&dir_locks[dirBlock % DIR_LOCKS]);
+	}
+}
+
+static void unlock_directory(long dirBlock) {
+	pthread_rwlock_unlock(&dir_locks[dirBlock % DIR_LOCKS]);
+}
+
+// =========== NAME INDEX ==============
+// Maps every name on the filesystem to where its entry lives, so resolving
+// "/dir/name.ext" is two hash lookups instead of strcmp-ing through the root
+// and then the directory. Directories are keyed under parent 0 and remember
+// their block, files are keyed under their directory's block. It is built at
+// mount and updated by mkdir and mknod while they hold the lock on whatever
+// they are changing, so it always agrees with the blocks it indexes.
+struct name_entry {
+	long parent;					// 0 for directories, else the directory's block
+	char name[MAX_FILENAME + 1];
+	char ext[MAX_EXTENSION + 1];	// Empty for directories
+	int slot;						// Index into root->directories or dir->files
+	long block;						// The directory's block (directories only)
+	struct name_entry * next;
+};
+
+struct name_index {
+	struct name_entry ** buckets;
+	long nBuckets;					// Always a power of two
+	long nEntries;
+	pthread_rwlock_t lock;
+};
+
+static struct name_index names = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+// FNV-1a over name, ext and the parent's block number
+static unsigned long name_hash(long parent, const char * name, const char * ext) {
+	unsigned long hash = 14695981039346656037UL;
+	while (*name) { hash = (hash ^ (unsigned char) *name++) * 1099511628211UL; }
+	hash = (hash ^ '.') * 1099511628211UL;
+	while (*ext) { hash = (hash ^ (unsigned char) *ext++) * 1099511628211UL; }
+	return (hash ^ (unsigned long) parent) * 1099511628211UL;
+}
+
+// Doubles the table once it holds as many entries as buckets (lock held)
+static void index_grow() {
+	long nBuckets = names.nBuckets == 0 ? 256 : names.nBuckets * 2;
+	struct name_entry ** buckets = calloc(nBuckets, sizeof(struct name_entry *));
+	if (buckets == NULL) { return; } // Keep the old table, chains just get longer
+	long i;
+	for (i = 0; i < names.nBuckets; i++) {
+		while (names.buckets[i] != NULL) {
+			struct name_entry * entry = names.buckets[i];
+			names.buckets[i] = entry->next;
+			struct name_entry ** bucket = &buckets[name_hash(entry->parent, entry->name, entry->ext) & (nBuckets - 1)];
+			entry->next = *bucket;
+			*bucket = entry;
+		}
+	}
+	free(names.buckets);
+	names.buckets = buckets;
+	names.nBuckets = nBuckets;
+}
+
+static int index_add(long parent, const char * name, const char * ext, int slot, long block) {
+	struct name_entry * entry = calloc(1, sizeof(struct name_entry));
+	if (entry == NULL) { return -ENOMEM; }
+	entry->parent = parent;
+	strncpy(entry->name, name, MAX_FILENAME);
+	strncpy(entry->ext, ext, MAX_EXTENSION);
+	entry->slot = slot;
+	entry->block = block;
+	pthread_rwlock_wrlock(&names.lock);
+	if (names.nEntries >= names.nBuckets) { index_grow(); }
+	struct name_entry ** bucket = &names.buckets[name_hash(parent, entry->name, entry->ext) & (names.nBuckets - 1)];
+	entry->next = *bucket;
+	*bucket = entry;
+	names.nEntries++;
+	pthread_rwlock_unlock(&names.lock);
+	return 0;
+}
+
+// Fills in slot and block (either can be NULL) for the name under parent
+static int index_find(long parent, const char * name, const char * ext, int * slot, long * block) {
+	int res = -ENOENT;
+	if (name == NULL) { return res; }
+	if (ext == NULL) { ext = ""; }
+	pthread_rwlock_rdlock(&names.lock);
+	if (names.nBuckets > 0) {
+		struct name_entry * entry = names.buckets[name_hash(parent, name, ext) & (names.nBuckets - 1)];
+		for (; entry != NULL; entry = entry->next) {
+			if (entry->parent == parent && strcmp(entry->name, name) == 0 && strcmp(entry->ext, ext) == 0) {
+				if (slot != NULL) { *slot = entry->slot; }
+				if (block != NULL) { *block = entry->block; }
+				res = 0;
+				break;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&names.lock);
+	return res;
+}
+
+static void index_destroy() {
+	long i;
+	for (i = 0; i < names.nBuckets; i++) {
+		while (names.buckets[i] != NULL) {
+			struct name_entry * entry = names.buckets[i];
+			names.buckets[i] = entry->next;
+			free(entry);
+		}
+	}
+	free(names.buckets);
+	names.buckets = NULL;
+	names.nBuckets = 0;
+	names.nEntries = 0;
+}
+
+// =========== ATTRIBUTE CACHE ==============
+// getattr is by far the most frequent call, so its answers (including "no
+// such file") are remembered by path. Every handler that changes what
+// getattr would say for a path forgets it while still holding the lock that
+// getattr takes to fill it in, so a cached answer is never stale. The kernel
+// keeps its own copy for entry_timeout/attr_timeout/negative_timeout seconds
+// (see main); this cache catches what falls through.
+#define MAX_PATH_LENGTH (1 + MAX_FILENAME + 1 + MAX_FILENAME + 1 + MAX_EXTENSION) // "/dir/name.ext"
+#define ATTR_CACHE_SLOTS 4096	// Direct mapped, a collision just replaces the old path
+#define ATTR_CACHE_LOCKS 64
+
+struct attr_entry {
+	char path[MAX_PATH_LENGTH + 1];	// Empty while the slot is unused
+	int res;						// 0, or -ENOENT for a negative entry
+	struct stat st;
+};
+
+static struct attr_entry attr_cache[ATTR_CACHE_SLOTS];
+static pthread_mutex_t attr_locks[ATTR_CACHE_LOCKS];
+
+static void attr_cache_init() {
+	int i;
+	for (i = 0; i < ATTR_CACHE_LOCKS; i++) { pthread_mutex_init(&attr_locks[i], NULL); }
+	for (i = 0; i < ATTR_CACHE_SLOTS; i++) { attr_cache[i].path[0] = '\0'; }
+}
+
+static unsigned long path_hash(const char * path) {
+	unsigned long hash = 14695981039346656037UL;
+	while (*path) { hash = (hash ^ (unsigned char) *path++) * 1099511628211UL; }
+	return hash;
+}
+
+static unsigned long attr_slot(const char * path) {
+	return path_hash(path) % ATTR_CACHE_SLOTS;
+}
+
+// Returns 0 or -ENOENT from the cache, or 1 if getattr has to work it out
+static int attr_cache_get(const char * path, struct stat * st) {
+	if (strlen(path) > MAX_PATH_LENGTH) { return 1; }
+	unsigned long slot = attr_slot(path);
+	int res = 1;
+	pthread_mutex_lock(&attr_locks[slot % ATTR_CACHE_LOCKS]);
+	if (strcmp(attr_cache[slot].path, path) == 0) {
+		res = attr_cache[slot].res;
+		*st = attr_cache[slot].st;
+	}
+	pthread_mutex_unlock(&attr_locks[slot % ATTR_CACHE_LOCKS]);
+	return res;
+}
+
+static void attr_cache_put(const char * path, int res, const struct stat * st) {
+	if (strlen(path) > MAX_PATH_LENGTH) { return; }
+	unsigned long slot = attr_slot(path);
+	pthread_mutex_lock(&attr_locks[slot % ATTR_CACHE_LOCKS]);
+	strcpy(attr_cache[slot].path, path);
+	attr_cache[slot].res = res;
+	attr_cache[slot].st = *st;
+	pthread_mutex_unlock(&attr_locks[slot % ATTR_CACHE_LOCKS]);
+}
+
+static void attr_cache_forget(const char * path) {
+	if (strlen(path) > MAX_PATH_LENGTH) { return; }
+	unsigned long slot = attr_slot(path);
+	pthread_mutex_lock(&attr_locks[slot % ATTR_CACHE_LOCKS]);
+	if (strcmp(attr_cache[slot].path, path) == 0) { attr_cache[slot].path[0] = '\0'; }
+	pthread_mutex_unlock(&attr_locks[slot % ATTR_CACHE_LOCKS]);
+}
+
+// =========== HELP FUNCTIONS ==============
+// Hands out the cached copy of a block. Every call has to be paired with
+// release_disk_block once the caller is done looking at it. Never returns NULL
+static void * get_disk_block(long blockNum) {
+	pthread_mutex_lock(&cache.lock);
+	struct cache_entry * entry = cache_lookup(blockNum);
+	struct cache_entry * victim = NULL;
+	while (entry == NULL && (victim = cache_victim()) == NULL) {
+		// Every slot is held by a handler, wait until one lets go. The block
+		// may have been read in by someone else in the meantime
+		cache.waits++;
+		pthread_cond_wait(&cache.released, &cache.lock);
+		entry = cache_lookup(blockNum);
+	}
+	if (entry != NULL) {
+		cache.hits++;
+	} else {
+		cache.misses++;
+		entry = victim;
+		if (entry->blockNum != -1) {
+			if (entry->dirty) { cache_writeback(entry); }
+			cache_unhash(entry);
+			cache.evictions++;
+		}
+		entry->blockNum = blockNum;
+		entry->resident = 0;
+		memcpy(cache_data(entry), disk_map + blockNum * BLOCK_SIZE, BLOCK_SIZE);
+		entry->hashNext = *cache_bucket(blockNum);
+		*cache_bucket(blockNum) = entry;
+	}
+	cache_touch(entry);
+	entry->pins++;
+	pthread_mutex_unlock(&cache.lock);
+	return cache_data(entry);
+}
+
+static void release_disk_block(void * block) {
+	if (block == NULL) { return; }
+	pthread_mutex_lock(&cache.lock);
+	if (--cache.entries[((char *) block - cache.data) / BLOCK_SIZE].pins == 0) {
+		pthread_cond_broadcast(&cache.released);
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
+
+// Flags a block handed out by get_disk_block as hot metadata
+static void keep_resident(void * block) {
+	pthread_mutex_lock(&cache.lock);
+	cache.entries[((char *) block - cache.data) / BLOCK_SIZE].resident = 1;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+static root_directory * get_root_directory() {
+	root_directory * root = (root_directory *) get_disk_block(geometry.nRootBlock);
+	keep_resident(root);
+	return root;
+}
+
+static directory_entry * get_directory(long blockNum) {
+	directory_entry * dir = (directory_entry *) get_disk_block(blockNum);
+	keep_resident(dir);
 	return dir;
 }
 
-static int write_file_to_disk(long blockNum, const char * buf, int size, int offset, FILE * disk) {
+// Indexes everything already on the disk, called once at mount
+static int index_build() {
 	int res = 0;
-	// Go to the block to write, plus offset
-	fseek(disk, (blockNum * BLOCK_SIZE) + offset, SEEK_SET);
-	// printf("Writing buffer starting at block %d + %d of size %d\n", blockNum, offset, size);
-	// Write the buffer to the disk
-	fwrite(buf, size, 1, disk);
+	int i, j;
+	root_directory * root = get_root_directory();
+	for (i = 0; i < root->nDirectories && res == 0; i++) {
+		long dirBlock = root->directories[i].nStartBlock;
+		res = index_add(0, root->directories[i].dname, "", i, dirBlock);
+		directory_entry * dir = get_directory(dirBlock);
+		for (j = 0; j < dir->nFiles && res == 0; j++) {
+			res = index_add(dirBlock, dir->files[j].fname, dir->files[j].fext, j, 0);
+		}
+		release_disk_block(dir);
+	}
+	release_disk_block(root);
 	return res;
 }
 
-// Modify and return number n at position p with bit value b
-static int modifyBit(char n, int p, int b) {
-    char mask = 1 << p;
-    return (n & ~mask) | ((b << p) & mask);
+// Marks the block dirty; the copy back to the image happens at flush, fsync
+// or eviction. Blocks built outside the cache are copied into it first
+static void write_to_disk(void * block, long blockNum) {
+	char * cached = block;
+	if (cached < cache.data || cached >= cache.data + (size_t) cache.nBlocks * BLOCK_SIZE) {
+		cached = get_disk_block(blockNum);
+		memcpy(cached, block, BLOCK_SIZE);
+		release_disk_block(cached);
+	}
+	pthread_mutex_lock(&cache.lock);
+	cache.entries[(cached - cache.data) / BLOCK_SIZE].dirty = 1;
+	pthread_mutex_unlock(&cache.lock);
+}
+
+// Copies dirty metadata into the image for flush and fsync. Every handler
+// that changes a block holds root_lock (shared) while it does, so taking it
+// exclusively here means no block is copied back half updated
+static void flush_metadata() {
+	pthread_rwlock_wrlock(&root_lock);
+	cache_flush();
+	bitmap_flush();
+	pthread_rwlock_unlock(&root_lock);
+}
+
+// Finds the directory through the name index, so the root block isn't read
+static directory_entry * get_directory_from_root(const char * directoryName, long * dirBlock) {
+	*dirBlock = 0;
+	if (index_find(0, directoryName, "", NULL, dirBlock) != 0) { return NULL; }
+	return get_directory(*dirBlock);
+}
+
+// Looks up "/directory/filename.extension" and copies the file's record
+// into file. Returns -EISDIR if the path names a directory instead. The
+// caller holds root_lock; on success the file's directory is left locked
+// shared (in *dirBlock) so the file can't change until unlock_directory
+static int get_file(const char * path, file_directory * file, long * dirBlock) {
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	// Ensure the \0 ending character
+	strcpy(directory, "");
+	strcpy(filename, "");
+	strcpy(extension, "");
+	sscanf(path, "/%8[^/]/%8[^.].%3s", directory, filename, extension);
+	directory_entry * dir = get_directory_from_root(directory, dirBlock);
+	if (dir == NULL) { return -ENOENT; }
+	if (strcmp(filename, "") == 0) { release_disk_block(dir); return -EISDIR; }
+	int slot;
+	lock_directory(*dirBlock, 0);
+	int res = index_find(*dirBlock, filename, extension, &slot, NULL);
+	if (res == 0) {
+		*file = dir->files[slot];
+	} else {
+		unlock_directory(*dirBlock);
+	}
+	release_disk_block(dir);
+	return res;
+}
+
+static int write_file_to_disk(long blockNum, const char * buf, size_t size, off_t offset) {
+	size_t start = (blockNum * BLOCK_SIZE) + offset;
+	// The image never grows, so anything past the last block is out of space
+	if (start + size > (size_t) geometry.nBlocks * BLOCK_SIZE) { return -ENOSPC; }
+	// printf("Writing buffer starting at block %d + %d of size %d\n", blockNum, offset, size);
+	// Copy the buffer straight into the mapping
+	memcpy(disk_map + start, buf, size);
+	__atomic_store_n(&disk_dirty, 1, __ATOMIC_RELAXED);
+	// Keep any cached copies of the blocks we just wrote over in step
+	long block;
+	pthread_mutex_lock(&cache.lock);
+	for (block = start / BLOCK_SIZE; size > 0 && block <= (long) ((start + size - 1) / BLOCK_SIZE); block++) {
+		struct cache_entry * entry = cache_lookup(block);
+		if (entry != NULL) {
+			memcpy(cache_data(entry), disk_map + block * BLOCK_SIZE, BLOCK_SIZE);
+			entry->dirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&cache.lock);
+	return 0;
+}
+
+// Data blocks skip the block cache and are copied straight out of the
+// mapping into the caller's buffer (write_file_to_disk keeps the two in step)
+static void read_file_from_disk(long blockNum, char * buf, size_t size, off_t offset) {
+	memcpy(buf, disk_map + (blockNum * BLOCK_SIZE) + offset, size);
+}
+
+// Pushes dirty pages of the mapping back to the .disk file. MS_ASYNC only
+// schedules the writeback (used on flush), MS_SYNC waits for it (fsync, unmount)
+static int sync_disk(int flags) {
+	if (!__atomic_load_n(&disk_dirty, __ATOMIC_RELAXED)) { return 0; }
+	if (flags == MS_SYNC) { __atomic_store_n(&disk_dirty, 0, __ATOMIC_RELAXED); }
+	if (msync(disk_map, disk_length, flags) != 0) { return -errno; }
+	return 0;
+}
+
+// Reads the geometry from the superblock and checks it fits the image.
+// Returns -EINVAL for anything mkfs.cs1550 wouldn't have written, which
+// includes images from before there was a superblock
+static int load_geometry() {
+	if (disk_length < sizeof(superblock)) { return -EINVAL; }
+	memcpy(&geometry, disk_map, sizeof(superblock));
+	superblock * sb = &geometry;
+	if (sb->magic != CS1550_MAGIC || sb->version != CS1550_VERSION) { return -EINVAL; }
+	if (sb->nBlockSize < MIN_BLOCK_SIZE || sb->nBlockSize > MAX_BLOCK_SIZE
+			|| (sb->nBlockSize & (sb->nBlockSize - 1)) != 0) { return -EINVAL; }
+	if (sb->nBlocks < 3 || sb->nBlocks > (long) (disk_length / sb->nBlockSize)) { return -EINVAL; }
+	if (sb->nBitmapStart <= 0 || sb->nBitmapBlocks <= 0 || sb->nBitmapStart > sb->nBlocks - sb->nBitmapBlocks
+			|| sb->nBitmapBlocks < (sb->nBlocks + sb->nBlockSize * 8 - 1) / (sb->nBlockSize * 8)) { return -EINVAL; }
+	if (sb->nRootBlock <= 0 || sb->nRootBlock >= sb->nBlocks
+			|| (sb->nRootBlock >= sb->nBitmapStart && sb->nRootBlock < sb->nBitmapStart + sb->nBitmapBlocks)) { return -EINVAL; }
+	return 0;
 }
 
 // Allows the mkdir() new directory to be assigned a block to hold all file links
-static long find_open_block(FILE * disk) {
-	// Accounts for the root block, which will never be open
-	fseek(disk, -(BIT_MAP_SIZE), SEEK_END);
-	char byte;
-	long byteCount = 0;
-	long bitCount = 0;
-	while(fread(&byte, 1, 1, disk) == 1) { // Read byte by byte
-		int i;
-		for (i = 0; i < 8; i++) { // Get the size in BITS
-			//printf("At byte %d and bit %d\n", byteCount, bitCount);
-			// The first 1 bit is for the root
-			if (byteCount == 0 && i < ROOT_BIT_OFFSET) {
-				// printf("Avoid at root\n");
-				bitCount ++;
+static long find_open_block() {
+	long i;
+	long hint = __atomic_load_n(&bitmap.hint, __ATOMIC_RELAXED);
+	for (i = 0; i < bitmap.nWords; i++) {
+		long word = (hint + i) % bitmap.nWords;
+		uint64_t old = __atomic_load_n(&bitmap.words[word], __ATOMIC_ACQUIRE);
+		while (old != ~0ULL) { // Skip words with all 64 blocks taken
+			int bit = __builtin_ctzll(~old); // Lowest open block in the word
+			// If another thread changed the word first, old is reloaded and we try again
+			if (__atomic_compare_exchange_n(&bitmap.words[word], &old, old | (1ULL << bit), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				bitmap_mark_dirty(word);
+				__atomic_sub_fetch(&bitmap.nFree, 1, __ATOMIC_RELAXED);
+				__atomic_store_n(&bitmap.hint, word, __ATOMIC_RELAXED); // Next fit: pick up where this search left off
+				return word * 64 + bit;
+			}
+		}
+	}
+	return -1; // If code makes it here, the disk is FULL
+}
+
+// Best fit: finds the smallest free run that holds all n blocks, or the
+// largest one there is when none does, and returns its start and length.
+// Full and empty words are skipped 64 blocks at a time.
+static long find_best_run(long n, long * runLen) {
+	long bestStart = -1, bestLen = 0;
+	int bestFits = 0;
+	long runStart = -1;
+	long b = 0;
+	*runLen = 0;
+	while (b <= bitmap.nBlocks) {
+		int used = 1; // Past the end counts as used so the last run gets closed
+		if (b < bitmap.nBlocks) {
+			uint64_t word = __atomic_load_n(&bitmap.words[b / 64], __ATOMIC_ACQUIRE);
+			if (b % 64 == 0 && (word == 0 || word == ~0ULL) && b + 64 <= bitmap.nBlocks) {
+				if (word == 0) { // 64 open blocks in a row
+					if (runStart == -1) { runStart = b; }
+					b += 64;
+					continue;
+				}
+			} else {
+				used = !bitmap_is_free(b);
+			}
+			if (!used) {
+				if (runStart == -1) { runStart = b; }
+				b++;
 				continue;
 			}
-			// The last 3 bits are for the bit map!
-			if (byteCount == BIT_MAP_SIZE && 7 - i <= BITMAP_BIT_OFFSET) {  printf("Avoid at bitmap blocks\n"); bitCount ++; continue; }
-			int bit = (byte >> i) & 0x1; // Get the ith bit in the byte
-			if (bit == 0) {
-				// printf("Open block found at block number %d\n", bitCount);
-				byte = modifyBit(byte, i, 1); // Write a 1 into the byte at position i
-				// printf("New byte is %d\n", byte);
-				fseek(disk, -1, SEEK_CUR); // Go back to the current byte
-				fwrite(&byte, 1, 1, disk); // Now write the new byte bitmap there!
-				return bitCount;
+		}
+		if (runStart != -1) { // A run of open blocks just ended
+			long len = b - runStart;
+			if (len >= n && (!bestFits || len < bestLen)) {
+				bestStart = runStart;
+				bestLen = len;
+				bestFits = 1;
+				if (len == n) { break; } // Can't do better than exact
+			} else if (!bestFits && len > bestLen) {
+				bestStart = runStart;
+				bestLen = len;
 			}
-			bitCount++;
+			runStart = -1;
 		}
-		byteCount++;
+		b += (b % 64 == 0 && b < bitmap.nBlocks && __atomic_load_n(&bitmap.words[b / 64], __ATOMIC_ACQUIRE) == ~0ULL) ? 64 : 1;
 	}
-	return -1; // If code makes it here, the disk is FULL
+	*runLen = bestLen;
+	return bestStart;
+}
+
+// Hands out a run of up to n contiguous blocks from the best fit run
+// (*got says how many were taken)
+static long find_open_run(long n, long * got) {
+	long start;
+	// Another thread can take the run between the scan and the claim
+	while ((start = find_best_run(n, got)) != -1) {
+		*got = bitmap_claim_following(start, *got < n ? *got : n);
+		if (*got > 0) { return start; }
+	}
+	return -1; // Disk is FULL
+}
+
+// True when start..start+n is made up of blocks that can hold file data,
+// which is everything but the superblock, the root and the bitmap
+static int data_blocks_valid(long start, long n) {
+	if (start < 1 || n <= 0 || start > geometry.nBlocks - n) { return 0; }
+	if (geometry.nRootBlock >= start && geometry.nRootBlock < start + n) { return 0; }
+	return start + n <= geometry.nBitmapStart || start >= geometry.nBitmapStart + geometry.nBitmapBlocks;
+}
+
+// Extent blocks come straight off the disk, so one is checked before
+// anything in it is trusted. A damaged image then fails with -EIO instead
+// of copying to or from wild addresses. Returns NULL if the block is bad
+static extent_block * get_extent_block(long blockNum) {
+	if (!data_blocks_valid(blockNum, 1)) {
+		LOG_ERROR("ERROR: Extent chain points at block %ld", blockNum);
+		return NULL;
+	}
+	extent_block * ext = get_disk_block(blockNum);
+	int valid = ext->nExtents >= 0 && ext->nExtents <= (long) MAX_EXTENTS_IN_BLOCK
+		&& (ext->nNextBlock == 0 || data_blocks_valid(ext->nNextBlock, 1));
+	long i;
+	for (i = 0; valid && i < ext->nExtents; i++) {
+		struct cs1550_extent * e = &ext->extents[i];
+		valid = data_blocks_valid(e->nStartBlock, e->nBlocks)
+			&& e->nFileBlock >= 0 && e->nFileBlock <= LONG_MAX / BLOCK_SIZE - e->nBlocks;
+	}
+	if (!valid) {
+		LOG_ERROR("ERROR: Extent block %ld is corrupt", blockNum);
+		release_disk_block(ext);
+		return NULL;
+	}
+	return ext;
+}
+
+// Grabs a block for a new extent block and clears it
+static long new_extent_block() {
+	long blockNum = find_open_block();
+	if (blockNum == -1) { return -1; }
+	extent_block * ext = get_disk_block(blockNum);
+	memset(ext, 0, BLOCK_SIZE);
+	write_to_disk((void *) ext, blockNum);
+	release_disk_block(ext);
+	return blockNum;
+}
+
+// Adds the run start..start+n to the end of the file's extent list. When it
+// picks up right where the last extent ends, that extent just gets longer
+static int extent_append(file_directory * file, long fileBlock, long start, long n) {
+	if (file->nStartBlock == 0) {
+		file->nStartBlock = new_extent_block();
+		if (file->nStartBlock == -1) { file->nStartBlock = 0; return -ENOSPC; }
+	}
+	long extBlock = file->nStartBlock;
+	long hops = 0;
+	extent_block * ext = get_extent_block(extBlock);
+	while (ext != NULL && ext->nNextBlock != 0) { // Walk to the end of the chain
+		extBlock = ext->nNextBlock;
+		release_disk_block(ext);
+		// A chain can't be longer than the disk, any longer and it loops
+		ext = ++hops < bitmap.nBlocks ? get_extent_block(extBlock) : NULL;
+	}
+	if (ext == NULL) { return -EIO; }
+	if (ext->nExtents > 0) {
+		struct cs1550_extent * last = &ext->extents[ext->nExtents - 1];
+		if (last->nStartBlock + last->nBlocks == start && last->nFileBlock + last->nBlocks == fileBlock) {
+			last->nBlocks += n;
+			write_to_disk((void *) ext, extBlock);
+			release_disk_block(ext);
+			return 0;
+		}
+	}
+	if (ext->nExtents == (long) MAX_EXTENTS_IN_BLOCK) { // This one is full, chain on another
+		long nextBlock = new_extent_block();
+		if (nextBlock == -1) { release_disk_block(ext); return -ENOSPC; }
+		ext->nNextBlock = nextBlock;
+		write_to_disk((void *) ext, extBlock);
+		release_disk_block(ext);
+		extBlock = nextBlock;
+		ext = get_disk_block(extBlock);
+	}
+	ext->extents[ext->nExtents].nFileBlock = fileBlock;
+	ext->extents[ext->nExtents].nStartBlock = start;
+	ext->extents[ext->nExtents].nBlocks = n;
+	ext->nExtents++;
+	write_to_disk((void *) ext, extBlock);
+	release_disk_block(ext);
+	return 0;
+}
+
+// Makes sure the file has blocks for its first newSize bytes. The last
+// extent is grown in place when the blocks after it are open, otherwise the
+// rest comes from find_open_run, so the file stays as contiguous as it can
+static int grow_file(file_directory * file, size_t newSize) {
+	long need = (newSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	long have = 0;
+	long lastEnd = -1; // Disk block right after the file's last block
+	long extBlock = file->nStartBlock;
+	long hops = 0;
+	while (extBlock != 0) {
+		extent_block * ext = hops++ < bitmap.nBlocks ? get_extent_block(extBlock) : NULL;
+		if (ext == NULL) { return -EIO; }
+		long i;
+		for (i = 0; i < ext->nExtents; i++) {
+			have += ext->extents[i].nBlocks;
+			lastEnd = ext->extents[i].nStartBlock + ext->extents[i].nBlocks;
+		}
+		extBlock = ext->nNextBlock;
+		release_disk_block(ext);
+	}
+	if (need <= have) { return 0; }
+	if (need - have > __atomic_load_n(&bitmap.nFree, __ATOMIC_RELAXED)) { return -ENOSPC; }
+	while (have < need) {
+		long got = 0;
+		long start = lastEnd;
+		if (lastEnd != -1) { got = bitmap_claim_following(lastEnd, need - have); }
+		if (got == 0) { start = find_open_run(need - have, &got); }
+		if (start == -1 || got == 0) { return -ENOSPC; }
+		int res = extent_append(file, have, start, got);
+		if (res != 0) { bitmap_free_run(start, got); return res; }
+		have += got;
+		lastEnd = start + got;
+	}
+	return 0;
+}
+
+// Called for each piece of a file range, in file order. A piece is either a
+// run of contiguous bytes on disk (diskOffset >= 0) or a gap the file has no
+// blocks for (diskOffset == -1)
+typedef int (*file_piece_fn)(void * arg, off_t fileOffset, off_t diskOffset, size_t len);
+
+// Splits [offset, offset + size) of a file into one piece per extent it
+// touches, so callers can move each piece with a single copy
+static int walk_file_range(long extBlock, size_t size, off_t offset, file_piece_fn fn, void * arg) {
+	off_t pos = offset;
+	off_t end = offset + size;
+	int res = 0;
+	long hops = 0;
+	while (extBlock != 0 && pos < end && res == 0) {
+		extent_block * ext = hops++ < bitmap.nBlocks ? get_extent_block(extBlock) : NULL;
+		if (ext == NULL) { return -EIO; }
+		long i, next = ext->nNextBlock;
+		for (i = 0; i < ext->nExtents && pos < end && res == 0; i++) {
+			struct cs1550_extent * e = &ext->extents[i];
+			off_t extStart = (off_t) e->nFileBlock * BLOCK_SIZE;
+			off_t extEnd = extStart + (off_t) e->nBlocks * BLOCK_SIZE;
+			off_t to = end < extEnd ? end : extEnd;
+			if (to <= pos) { continue; }
+			if (extStart > pos) { // Nothing on disk until this extent starts
+				off_t gapEnd = extStart < end ? extStart : end;
+				res = fn(arg, pos, -1, gapEnd - pos);
+				pos = gapEnd;
+				if (res != 0 || pos >= end) { break; }
+			}
+			res = fn(arg, pos, (off_t) e->nStartBlock * BLOCK_SIZE + (pos - extStart), to - pos);
+			pos = to;
+		}
+		release_disk_block(ext);
+		extBlock = next;
+	}
+	if (res == 0 && pos < end) { res = fn(arg, pos, -1, end - pos); }
+	return res;
+}
+
+struct file_copy {
+	char * buf;		// Caller's buffer, holds the byte at offset
+	off_t offset;
+};
+
+static int write_piece(void * arg, off_t fileOffset, off_t diskOffset, size_t len) {
+	struct file_copy * copy = arg;
+	if (diskOffset == -1) { return -EIO; } // grow_file should have covered this
+	return write_file_to_disk(diskOffset / BLOCK_SIZE, copy->buf + (fileOffset - copy->offset), len, diskOffset % BLOCK_SIZE);
+}
+
+// Writes size bytes at offset into the file's blocks, one copy per extent
+static int write_file_extents(long extBlock, const char * buf, size_t size, off_t offset) {
+	struct file_copy copy = { (char *) buf, offset };
+	return walk_file_range(extBlock, size, offset, write_piece, &copy);
+}
+
+static int read_piece(void * arg, off_t fileOffset, off_t diskOffset, size_t len) {
+	struct file_copy * copy = arg;
+	char * dest = copy->buf + (fileOffset - copy->offset);
+	if (diskOffset == -1) {
+		memset(dest, 0, len); // No blocks there, so it reads as zeroes
+	} else {
+		read_file_from_disk(diskOffset / BLOCK_SIZE, dest, len, diskOffset % BLOCK_SIZE);
+	}
+	return 0;
+}
+
+// Reads up to size bytes at offset straight into buf, one copy per extent.
+// Returns how many bytes were read, which is short at the end of the file
+static int read_file_extents(long extBlock, size_t fsize, char * buf, size_t size, off_t offset) {
+	if (offset >= (off_t) fsize) { return 0; }
+	if (offset + size > fsize) { size = fsize - offset; }
+	struct file_copy copy = { buf, offset };
+	int res = walk_file_range(extBlock, size, offset, read_piece, &copy);
+	return res != 0 ? res : (int) size;
+}
+
+// =========== READAHEAD ==============
+// Each open file remembers where its last read ended (in fi->fh). Once reads
+// line up back to back the next window of the file is handed to the kernel
+// with MADV_WILLNEED, which starts reading it into the mapping in the
+// background, and the window doubles every sequential read up to the max.
+// Data blocks never go through the block cache, so the page cache is where
+// prefetched blocks land
+#define READAHEAD_MIN (128 * 1024)
+#define READAHEAD_MAX (4 * 1024 * 1024)
+
+struct open_file {
+	pthread_mutex_t lock;	// Reads on the same handle can run at once
+	off_t nextOffset;		// Where a sequential read would start
+	size_t window;			// Bytes to keep prefetched past nextOffset, 0 while reads look random
+	off_t readahead;		// Everything before this has already been prefetched
+	struct open_path * file;	// Shared by every handle open on the path (see WRITE BUFFER)
+};
+
+static long page_size = 4096;
+
+static struct open_file * open_file_of(struct fuse_file_info * fi) {
+	return fi == NULL ? NULL : (struct open_file *) (uintptr_t) fi->fh;
+}
+
+static int willneed_piece(void * arg, off_t fileOffset, off_t diskOffset, size_t len) {
+	(void) arg;
+	(void) fileOffset;
+	if (diskOffset == -1) { return 0; }
+	off_t start = diskOffset & ~((off_t) page_size - 1); // madvise wants a page aligned address
+	madvise(disk_map + start, len + (diskOffset - start), MADV_WILLNEED);
+	return 0;
+}
+
+// Called for every read with the file's directory still locked, so its
+// extents can be walked. Random reads just reset the stream
+static void readahead(struct open_file * stream, const file_directory * file, off_t offset, size_t size) {
+	if (stream == NULL) { return; }
+	pthread_mutex_lock(&stream->lock);
+	if (offset == stream->nextOffset) {
+		if (stream->window == 0) { stream->window = READAHEAD_MIN; }
+		else if (stream->window < READAHEAD_MAX) { stream->window *= 2; }
+	} else {
+		stream->window = 0;
+		stream->readahead = 0;
+	}
+	stream->nextOffset = offset + size;
+	off_t from = stream->readahead > stream->nextOffset ? stream->readahead : stream->nextOffset;
+	off_t to = stream->nextOffset + stream->window;
+	if (to > (off_t) file->fsize) { to = file->fsize; }
+	// Only top the window up once half of it has been read (or the rest of
+	// the file is in reach), so the advice goes out in big pieces
+	if (stream->window != 0 && to > from
+			&& ((to - from) * 2 >= (off_t) stream->window || to == (off_t) file->fsize)) {
+		walk_file_range(file->nStartBlock, to - from, from, willneed_piece, NULL);
+		stream->readahead = to;
+	}
+	pthread_mutex_unlock(&stream->lock);
+}
+
+// =========== WRITE BUFFER ==============
+// The kernel splits a big write into many small ones. Writes through open
+// handles that continue where the last one stopped are collected in memory,
+// and only go to the file (one grow_file, one copy per extent, one directory
+// update) when the file is flushed, synced or released, when a write
+// doesn't follow on, or when the buffer reaches WRITE_BUFFER_MAX.
+// The buffer belongs to the path rather than the handle, so writes through
+// different handles still land in the order they were made. getattr counts
+// buffered bytes in the size it reports and every read commits them first,
+// so the file never looks like it is missing them. If the commit at release
+// fails the buffer is kept, and the next flush, fsync or unmount retries it
+// and reports the error.
+// Lock order: open_path.lock, then root_lock and the rest. open_paths.lock
+// is only held to find an entry, never while taking another lock
+#define WRITE_BUFFER_MIN (64 * 1024)
+#define WRITE_BUFFER_MAX (8 * 1024 * 1024)
+#define OPEN_PATH_BUCKETS 256
+
+struct open_path {
+	char * path;
+	int nRefs;				// Open handles, plus anyone looking at the buffer
+	pthread_mutex_t lock;	// Guards the buffer
+	char * pending;
+	off_t pendingOffset;	// File offset of pending[0]
+	size_t pendingSize;
+	size_t pendingCap;
+	struct open_path * next;
+};
+
+struct open_path_table {
+	pthread_mutex_t lock;	// Guards the chains and every nRefs
+	long nPaths;			// Lets lookups skip the table while nothing is open
+	struct open_path * buckets[OPEN_PATH_BUCKETS];
+};
+
+static struct open_path_table open_paths = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Finds the entry for path, adding one if create is set. The entry comes
+// back with a reference that open_path_put drops
+static struct open_path * open_path_get(const char * path, int create) {
+	if (!create && __atomic_load_n(&open_paths.nPaths, __ATOMIC_ACQUIRE) == 0) { return NULL; }
+	pthread_mutex_lock(&open_paths.lock);
+	struct open_path ** bucket = &open_paths.buckets[path_hash(path) % OPEN_PATH_BUCKETS];
+	struct open_path * entry = *bucket;
+	while (entry != NULL && strcmp(entry->path, path) != 0) { entry = entry->next; }
+	if (entry == NULL && create && (entry = calloc(1, sizeof(struct open_path))) != NULL) {
+		entry->path = strdup(path);
+		if (entry->path == NULL) {
+			free(entry);
+			entry = NULL;
+		} else {
+			pthread_mutex_init(&entry->lock, NULL);
+			entry->next = *bucket;
+			*bucket = entry;
+			__atomic_add_fetch(&open_paths.nPaths, 1, __ATOMIC_RELEASE);
+		}
+	}
+	if (entry != NULL) { entry->nRefs++; }
+	pthread_mutex_unlock(&open_paths.lock);
+	return entry;
+}
+
+// The entry goes away with its last reference, unless it still holds writes
+// that couldn't be committed
+static void open_path_put(struct open_path * entry) {
+	pthread_mutex_lock(&open_paths.lock);
+	if (--entry->nRefs == 0 && entry->pendingSize == 0) {
+		struct open_path ** link = &open_paths.buckets[path_hash(entry->path) % OPEN_PATH_BUCKETS];
+		while (*link != entry) { link = &(*link)->next; }
+		*link = entry->next;
+		__atomic_sub_fetch(&open_paths.nPaths, 1, __ATOMIC_RELEASE);
+	} else {
+		entry = NULL;
+	}
+	pthread_mutex_unlock(&open_paths.lock);
+	if (entry != NULL) {
+		pthread_mutex_destroy(&entry->lock);
+		free(entry->pending);
+		free(entry->path);
+		free(entry);
+	}
+}
+
+// Writes size bytes at offset straight into the file, returns 0 or an error
+static int write_file(const char * path, const char * buf, size_t size, off_t offset) {
+	int res = 0;
+	char * directory;
+	char * filename;
+	char * extension;
+	char pathCopy[strlen(path)];
+	strcpy(pathCopy, path);
+	directory = strtok(pathCopy, "/");
+	filename = strtok(NULL, "."); //NULL indicates to continue where strtok left off at
+	extension = strtok(NULL, ".");
+	directory_entry * dir = NULL;
+	long dirBlock = 0;
+	int i;
+	// Check for the directory existing
+	pthread_rwlock_rdlock(&root_lock);
+	dir = get_directory_from_root(directory, &dirBlock);
+	if (dir == NULL) {
+		pthread_rwlock_unlock(&root_lock);
+		return -ENOENT;
+	}
+	lock_directory(dirBlock, 1);
+	// Check for the file existing
+	res = index_find(dirBlock, filename, extension, &i, NULL);
+	if (res == 0) {
+		if (offset > (off_t) dir->files[i].fsize) { // Make sure that we don't leave a gap in the file
+			res = -EFBIG;
+		} else {
+			// Make sure the file has blocks all the way to the end of this write
+			res = grow_file(&dir->files[i], offset + size);
+			// We also have to write the file's data to disk at the recorded blocks!
+			if (res == 0) { res = write_file_extents(dir->files[i].nStartBlock, buf, size, offset); }
+			if (res == 0 && offset + (off_t) size > (off_t) dir->files[i].fsize) { dir->files[i].fsize = offset + size; }
+			// printf("The size of the new file %s is %d (%d as a strlen)\n", dir->files[i].fname, dir->files[i].fsize, strlen(buf));
+			// Once we update the directory to have the new cs1550_file_directory, we can update the directory
+			write_to_disk((void *) dir, dirBlock);
+			attr_cache_forget(path);
+		}
+	}
+	unlock_directory(dirBlock);
+	release_disk_block(dir);
+	pthread_rwlock_unlock(&root_lock);
+	return res;
+}
+
+// Called with entry->lock held. The buffer is only emptied once it is in
+// the file, so a failed commit can be tried again
+static int commit_writes(struct open_path * entry) {
+	if (entry->pendingSize == 0) { return 0; }
+	int res = write_file(entry->path, entry->pending, entry->pendingSize, entry->pendingOffset);
+	LOG_DEBUG("Committed %zu buffered bytes at %ld of %s (%d)", entry->pendingSize, (long) entry->pendingOffset, entry->path, res);
+	if (res == 0) { entry->pendingSize = 0; }
+	return res;
+}
+
+// Called with entry->lock held
+static int buffer_write(struct open_path * entry, const char * buf, size_t size, off_t offset) {
+	const char * path = entry->path;
+	int res = 0;
+	if (entry->pendingSize != 0 && (offset != entry->pendingOffset + (off_t) entry->pendingSize
+			|| entry->pendingSize + size > WRITE_BUFFER_MAX)) {
+		res = commit_writes(entry);
+		if (res != 0) { return res; }
+	}
+	if (size >= WRITE_BUFFER_MAX) { return write_file(path, buf, size, offset); }
+	if (entry->pendingSize == 0) {
+		// Check now what write_file would, since nothing reaches it until later
+		file_directory file;
+		long dirBlock = 0;
+		pthread_rwlock_rdlock(&root_lock);
+		res = get_file(path, &file, &dirBlock);
+		if (res == 0) {
+			if (offset > (off_t) file.fsize) { res = -EFBIG; } // Make sure that we don't leave a gap in the file
+			unlock_directory(dirBlock);
+		}
+		pthread_rwlock_unlock(&root_lock);
+		if (res != 0) { return res; }
+		entry->pendingOffset = offset;
+	}
+	if (entry->pendingSize + size > entry->pendingCap) {
+		size_t cap = entry->pendingCap == 0 ? WRITE_BUFFER_MIN : entry->pendingCap;
+		while (cap < entry->pendingSize + size) { cap *= 2; }
+		char * grown = realloc(entry->pending, cap);
+		if (grown == NULL) { return -ENOMEM; }
+		entry->pending = grown;
+		entry->pendingCap = cap;
+	}
+	memcpy(entry->pending + entry->pendingSize, buf, size);
+	entry->pendingSize += size;
+	return 0;
+}
+
+// Commits whatever is buffered for path, for read, write, flush and fsync
+static int commit_path(const char * path) {
+	struct open_path * entry = open_path_get(path, 0);
+	if (entry == NULL) { return 0; }
+	pthread_mutex_lock(&entry->lock);
+	int res = commit_writes(entry);
+	pthread_mutex_unlock(&entry->lock);
+	open_path_put(entry);
+	return res;
+}
+
+// getattr reports the size the file will have once its buffer is committed
+static void add_pending_size(const char * path, struct stat * st) {
+	struct open_path * entry = open_path_get(path, 0);
+	if (entry == NULL) { return; }
+	pthread_mutex_lock(&entry->lock);
+	off_t end = entry->pendingOffset + entry->pendingSize;
+	if (entry->pendingSize != 0 && end > st->st_size) { st->st_size = end; }
+	pthread_mutex_unlock(&entry->lock);
+	open_path_put(entry);
+}
+
+// Last chance for buffers whose commit failed at release, called at unmount
+static void open_paths_destroy() {
+	int i;
+	for (i = 0; i < OPEN_PATH_BUCKETS; i++) {
+		while (open_paths.buckets[i] != NULL) {
+			struct open_path * entry = open_paths.buckets[i];
+			int res = commit_writes(entry);
+			if (res != 0) { LOG_ERROR("ERROR: Lost %zu buffered bytes of %s (%d)", entry->pendingSize, entry->path, res); }
+			open_paths.buckets[i] = entry->next;
+			pthread_mutex_destroy(&entry->lock);
+			free(entry->pending);
+			free(entry->path);
+			free(entry);
+		}
+	}
+	open_paths.nPaths = 0;
 }
 
 // =========================================
@@ -208,82 +1382,88 @@ static long find_open_block(FILE * disk) {
 static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
 			  struct fuse_file_info *fi)
 {
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
-	(void) size;
-	printf("=======================\n");
-	printf("read() debug messages:\n");
+	LOG_DEBUG("read(%s, %zu bytes at %ld)", path, size, (long) offset);
+	// Writes still sitting in a buffer have to be visible to the reader
+	int res = commit_path(path);
+	if (res != 0) { return res; }
 	//check to make sure path exists
 	//check that size is > 0
 	//check that offset is <= to the file size
 	//read in data
 	//set size and return, or error
-	int res = 0;
-	char * directory;
-	char * filename;
-	char * extension;
-	char pathCopy[strlen(path)];
-	strcpy(pathCopy, path);
-	printf("Path %s\n", path);
-	directory = strtok(pathCopy, "/");
-	filename = strtok(NULL, "."); //NULL indicates to continue where strtok left off at
-	extension = strtok(NULL, ".");
-	FILE * disk = fopen(DISK_FILE_NAME, "rb+");
-	root_directory * root = get_root_directory(disk);
-	directory_entry * dir = NULL;
+	file_directory file;
 	long dirBlock = 0;
-	size_t filesize = 0;
-	int i;
-	// Check to see if file requested is a directory
-	dir = get_directory_from_root(filename, &dirBlock);
-	if (dir != NULL) {
-		// You cannot request a file as a directory
-		return -EISDIR;
-	} else {
-		// Check for the directory existing
-		dir = get_directory_from_root(directory, &dirBlock);
-		printf("Good! Beginning to search thru directory %s with %d files\n", directory, dir->nFiles);
-		for (i = 0; i < dir->nFiles; i++) {
-			printf("Looking for file. Comparing %s to %s\n", filename, dir->files[i].fname);
-			if (strcmp(dir->files[i].fext, extension) == 0) { printf("Test\n"); }
-			if (strcmp(dir->files[i].fname, filename) == 0) {
-				filesize = dir->files[i].fsize;
-				// printf("The filesize is %d and offset is %d\n", filesize, offset);
-				if (filesize > offset) {
-					// Seek to the beginning of the file
-					fseek(disk, dir->files[i].nStartBlock * BLOCK_SIZE, SEEK_SET);
-					int j;
-					int blocks2read = (filesize / BLOCK_SIZE) + 1; // Ensures a round-up
-					for (j = 0; j < blocks2read; j++) {
-						disk_block * curr_block = malloc(BLOCK_SIZE);
-						fread(curr_block, BLOCK_SIZE, 1, disk);
-						int bytes = 0;
-						while (bytes < MAX_DATA_IN_BLOCK) {
-							// Read the file into buf[] to read
-							buf[bytes] = curr_block->data[bytes];
-							bytes ++;
-						}
-						printf("Read %d bytes\n", bytes);
-						printf("Reading block %d of %d starting at block %ld\n", j, blocks2read, dir->files[i].nStartBlock);
-						free(curr_block);
-					}
-				} else {
-					res = -1;
-				}
-			}
-			break;
-		}
+	pthread_rwlock_rdlock(&root_lock);
+	res = get_file(path, &file, &dirBlock);
+	if (res == 0) {
+		readahead(open_file_of(fi), &file, offset, size);
+		// Copies just the blocks covering offset..offset+size, straight into buf
+		res = read_file_extents(file.nStartBlock, file.fsize, buf, size, offset);
+		LOG_DEBUG("Read %d bytes at offset %ld of %s", res, (long) offset, path);
+		unlock_directory(dirBlock);
+	}
+	pthread_rwlock_unlock(&root_lock);
+	return res;
+}
+
+#if FUSE_VERSION >= 29
+static int count_piece(void * arg, off_t fileOffset, off_t diskOffset, size_t len) {
+	(void) fileOffset;
+	(void) diskOffset;
+	(void) len;
+	(*(size_t *) arg)++;
+	return 0;
+}
+
+static int bufvec_piece(void * arg, off_t fileOffset, off_t diskOffset, size_t len) {
+	(void) fileOffset;
+	struct fuse_bufvec * vec = arg;
+	struct fuse_buf * piece = &vec->buf[vec->count++];
+	piece->size = len;
+	if (diskOffset == -1) { // Nothing on disk to point at, hand over zeroes
+		piece->mem = calloc(1, len);
+		if (piece->mem == NULL) { return -ENOMEM; }
+	} else { // FUSE reads (or splices) this range of the .disk file itself
+		piece->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		piece->fd = disk_fd;
+		piece->pos = diskOffset;
 	}
-	printf("=======================\n");
-	free(dir);
-	free(root);
-	fclose(disk);
+	return 0;
+}
 
+/*
+ * Same as read, but instead of copying the data out it hands FUSE the
+ * ranges of the .disk file that hold it. The kernel can then splice them
+ * to the reader without the bytes ever passing through this process.
+ */
+static int cs1550_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	int res = commit_path(path);
 	if (res != 0) { return res; }
-	return filesize - offset;
+	file_directory file;
+	long dirBlock = 0;
+	pthread_rwlock_rdlock(&root_lock);
+	res = get_file(path, &file, &dirBlock);
+	if (res != 0) { pthread_rwlock_unlock(&root_lock); return res; }
+	readahead(open_file_of(fi), &file, offset, size);
+	if (offset >= (off_t) file.fsize) { size = 0; }
+	else if (offset + size > file.fsize) { size = file.fsize - offset; }
+	size_t pieces = 0;
+	walk_file_range(file.nStartBlock, size, offset, count_piece, &pieces);
+	// fuse_bufvec already has room for one fuse_buf
+	struct fuse_bufvec * vec = calloc(1, sizeof(struct fuse_bufvec) + pieces * sizeof(struct fuse_buf));
+	if (vec == NULL) {
+		res = -ENOMEM;
+	} else {
+		res = walk_file_range(file.nStartBlock, size, offset, bufvec_piece, vec);
+		*bufp = vec; // FUSE frees vec and any piece memory once it has replied
+	}
+	unlock_directory(dirBlock);
+	pthread_rwlock_unlock(&root_lock);
+	return res;
 }
+#endif
 
 /*
  * Write size bytes from buf into file starting from offset
@@ -292,57 +1472,22 @@ static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
 static int cs1550_write(const char *path, const char *buf, size_t size,
 			  off_t offset, struct fuse_file_info *fi)
 {
-	printf("=======================\n");
-	printf("write() debug messages:\n");
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
-	int res = 0;
-	char * directory;
-	char * filename;
-	char * extension;
-	char pathCopy[strlen(path)];
-	strcpy(pathCopy, path);
-	printf("Path %s\n", path);
-	directory = strtok(pathCopy, "/");
-	filename = strtok(NULL, "."); //NULL indicates to continue where strtok left off at
-	extension = strtok(NULL, ".");
-	FILE * disk = fopen(DISK_FILE_NAME, "rb+");
-	root_directory * root = get_root_directory(disk);
-	directory_entry * dir = NULL;
-	long dirBlock = 0;
-	int i;
-	// Check for the directory existing
-	dir = get_directory_from_root(directory, &dirBlock);
-	// Check for the file existing
-	for (i = 0; i < dir->nFiles; i++) {
-		if (strcmp(dir->files[i].fname, filename) == 0) {
-			if (strcmp(dir->files[i].fext, extension) == 0) { printf("Test\n"); }
-			if (offset > size) { // Make sure that we don't go over the limit
-				res = -EFBIG;
-			} else {
-				// Assign the size of the new block
-				dir->files[i].fsize = size;
-				dir->files[i].nStartBlock = find_open_block(disk);
-				// printf("The size of the new file %s is %d (%d as a strlen)\n", dir->files[i].fname, dir->files[i].fsize, strlen(buf));
-				// Once we update the directory to have the new cs1550_file_directory, we can update the directory
-				write_to_disk((void *) dir, dirBlock, disk);
-				// We also have to write the file's data to disk at the recorded block!
-				res = write_file_to_disk(dir->files[i].nStartBlock, buf, size, offset, disk);
-			}
-			break;
-		}
+	LOG_DEBUG("write(%s, %zu bytes at %ld)", path, size, (long) offset);
+	int res;
+	struct open_file * stream = open_file_of(fi);
+	if (stream == NULL) { // Not through an open handle, so it can't be buffered
+		res = commit_path(path);
+		if (res == 0) { res = write_file(path, buf, size, offset); }
+	} else {
+		pthread_mutex_lock(&stream->file->lock);
+		res = buffer_write(stream->file, buf, size, offset);
+		pthread_mutex_unlock(&stream->file->lock);
 	}
-	fclose(disk);
-	free(root);
-	free(dir);
 	//check to make sure path exists
 	//check that size is > 0
 	//check that offset is <= to the file size
 	//write data
 	//set size (should be same as input) and return, or error
-	printf("=======================\n");
 	if (res == 0) { return size; }
 	return res;
 }
@@ -355,15 +1500,13 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 	(void) path;
 	(void) mode;
 	(void) dev;
-	printf("=======================\n");
-	printf("mknod() debug messages:\n");
+	LOG_DEBUG("mknod(%s)", path);
 	int res = 0;
 	char * directory;
 	char * filename;
 	char * extension;
 	char pathCopy[strlen(path)];
 	strcpy(pathCopy, path);
-	printf("Path %s\n", path);
 	directory = strtok(pathCopy, "/");
 	filename = strtok(NULL, "."); //NULL indicates to continue where strtok left off at
 	extension = strtok(NULL, ".");
@@ -371,43 +1514,42 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 	if (filename == NULL) { // You cannot have a file in root!
 		return -EPERM; // No permissions to make a file in root >:(
 	}
-	FILE * disk = fopen(DISK_FILE_NAME, "rb+");
-
 	// Check for too large file names and extensions
 	if (strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION) {
 		return -ENAMETOOLONG;
 	}
-	root_directory * root = get_root_directory(disk);
 	directory_entry * dir = NULL;
 	long dirBlock = 0;
 	int i;
 	// Get the directory
+	pthread_rwlock_rdlock(&root_lock);
 	dir = get_directory_from_root(directory, &dirBlock);
-	// Check for duplicate files!
-	for (i = 0; i < dir->nFiles; i++) {
-		// printf("Comparing existing file %s to new file %s\n", dir->files[i].fname, filename);
-		if (strcmp(dir->files[i].fname, filename) == 0) {
-			printf("MATCH!\n");
-			i = -1;
-			break;
-		}
+	if (dir == NULL) {
+		pthread_rwlock_unlock(&root_lock);
+		return -ENOENT;
 	}
-	// Create the file once we know its NOT in root and NOT a dupe
-	if (i != -1) {
+	lock_directory(dirBlock, 1);
+	// Check for duplicate files!
+	if (index_find(dirBlock, filename, extension, NULL, NULL) == 0) {
+		LOG_DEBUG("%s already exists", path);
+		res = -EEXIST;
+	} else { // Create the file once we know its NOT in root and NOT a dupe
+		i = dir->nFiles;
 		strcpy(dir->files[dir->nFiles].fname, filename);
 		strcpy(dir->files[dir->nFiles].fext, extension);
-		dir->files[dir->nFiles].nStartBlock = find_open_block(disk);
+		// No blocks until the first write
+		dir->files[dir->nFiles].fsize = 0;
+		dir->files[dir->nFiles].nStartBlock = 0;
 		// printf("FILE %s with extension %s created at open block %d\n", dir->files[dir->nFiles].fname, dir->files[dir->nFiles].fext, dir->files[dir->nFiles].nStartBlock);
 		dir->nFiles = dir->nFiles + 1;
 		// Write the updated directory back to disk
-		write_to_disk((void *) dir, dirBlock, disk);
-	} else {
-		res = -EEXIST;
+		write_to_disk((void *) dir, dirBlock);
+		res = index_add(dirBlock, filename, extension, i, 0);
+		attr_cache_forget(path);
 	}
-	printf("=======================\n");
-	fclose(disk);
-	free(root);
-	free(dir);
+	unlock_directory(dirBlock);
+	release_disk_block(dir);
+	pthread_rwlock_unlock(&root_lock);
 	return res;
 }
 
@@ -418,12 +1560,10 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			 off_t offset, struct fuse_file_info *fi)
 {
-	printf("=======================\n");
-	printf("readdir() debug messages:\n");
+	LOG_DEBUG("readdir(%s)", path);
 	(void) offset;
 	(void) fi;
 
-	printf("Path %s\n", path);
 	char directory[MAX_FILENAME + 1];
 	char filename[MAX_FILENAME + 1];
 	char extension[MAX_EXTENSION + 1];
@@ -433,12 +1573,9 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	strcpy(extension, "");
 	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
 
-	FILE * disk = fopen(DISK_FILE_NAME, "rb+");
-	if (disk == NULL) {
-		printf("ERROR: Could not open the disk\n");
-	}
 	// Get the root from the disk
-	root_directory * root = get_root_directory(disk);
+	pthread_rwlock_rdlock(&root_lock);
+	root_directory * root = get_root_directory();
 
 	//the filler function allows us to add entries to the listing
 	//read the fuse.h file for a description (in the ../include dir)
@@ -448,28 +1585,31 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		int i;
 		for (i = 0; i < root->nDirectories; i++) {
 			char * name = root->directories[i].dname;
-			int start = root->directories[i].nStartBlock;
 			filler(buf, name, NULL, 0);
-			printf("Directory %d name is %s and starts at %d\n", i, name, start);
+			LOG_DEBUG("Directory %d name is %s and starts at %ld", i, name, root->directories[i].nStartBlock);
 		}
 	} else if (strcmp(directory, "") != 0) { // If you are reading from a subdirectory...
 		long dirBlock = 0;
 		directory_entry * dir = get_directory_from_root(directory, &dirBlock);
 		int i;
-		for (i = 0; i < dir->nFiles; i++) {
-			filler(buf, strcat(strcat(dir->files[i].fname, "."), dir->files[i].fext), NULL, 0);
+		if (dir != NULL) { lock_directory(dirBlock, 0); }
+		for (i = 0; dir != NULL && i < dir->nFiles; i++) {
+			// dir points into the image, so build the name on the side instead of strcat-ing onto fname
+			char name[MAX_FILENAME + MAX_EXTENSION + 2];
+			snprintf(name, sizeof(name), "%s.%s", dir->files[i].fname, dir->files[i].fext);
+			filler(buf, name, NULL, 0);
 		}
+		if (dir != NULL) { unlock_directory(dirBlock); }
+		release_disk_block(dir);
 	}
-
-	free(root);
-	fclose(disk);
+	release_disk_block(root);
+	pthread_rwlock_unlock(&root_lock);
 
 	/*
 	//add the user stuff (subdirs or files)
 	//the +1 skips the leading '/' on the filenames
 	filler(buf, newpath + 1, NULL, 0);
 	*/
-	printf("=======================\n");
 	return 0;
 }
 
@@ -481,8 +1621,7 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
  */
 static int cs1550_getattr(const char *path, struct stat *stbuf)
 {
-	printf("=======================\n");
-	printf("getattr() debug messages:\n");
+	LOG_DEBUG("getattr(%s)", path);
 	int res = 0;
 	memset(stbuf, 0, sizeof(struct stat));
 	// Info about the "struct stat": http://pubs.opengroup.org/onlinepubs/007908799/xsh/sysstat.h.html
@@ -495,8 +1634,10 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
 		// Set the number of links to this file from other files
 		// 2 because __?__
 		stbuf->st_nlink = 2;
+	} else if ((res = attr_cache_get(path, stbuf)) != 1) {
+		LOG_DEBUG("getattr(%s) answered from the attribute cache", path);
 	} else {
-		printf("Path %s\n", path);
+		res = 0;
 		char directory[MAX_FILENAME + 1];
 		char filename[MAX_FILENAME + 1];
 		char extension[MAX_FILENAME + 1];
@@ -506,9 +1647,7 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
 		strcpy(extension, "");
 
 		sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-		printf("directory: %s\n", directory);
-		printf("filename: %s\n", filename);
-		printf("extension: %s\n", extension);
+		LOG_DEBUG("directory: %s filename: %s extension: %s", directory, filename, extension);
 
 		// Check for too large file names and extensions
 		if (strlen(directory) > MAX_FILENAME || strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION) {
@@ -520,37 +1659,38 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
 		if (strcmp(directory, "") == 0) { // If no directory is given...
 			return -ENOENT;
 		} else { // Check to see if directory exists
-			FILE * disk = fopen(DISK_FILE_NAME, "rb+");
-			root_directory * root = get_root_directory(disk);
 			long dirBlock = 0;
+			pthread_rwlock_rdlock(&root_lock);
 			directory_entry * dir = get_directory_from_root(directory, &dirBlock);
 			if (dir == NULL) { // Directory was not found
-				res = -ENOENT; // DO NOT return here, disk still open
+				res = -ENOENT;
+				attr_cache_put(path, res, stbuf); // mkdir can't add it while we hold root_lock
 			} else {
+				lock_directory(dirBlock, 0);
 				if (strcmp(filename, "") != 0) { // We look for a file
 					int i;
-					for (i = 0; i < dir->nFiles; i++) {
-						printf("Comparing existing file %s to the file %s out of %d total files\n", dir->files[i].fname, filename, dir->nFiles);
-						if (strcmp(dir->files[i].fname, filename) == 0) {
-							printf("FILE %s FOUND!\n", filename);
-							stbuf->st_size = dir->files[i].fsize; // file size
-							stbuf->st_mode = S_IFREG | 0666;
-							stbuf->st_nlink = 1; // file links
-							i = -1;
-							break;
-						}
+					if (index_find(dirBlock, filename, extension, &i, NULL) == 0) {
+						LOG_DEBUG("FILE %s FOUND!", filename);
+						stbuf->st_size = dir->files[i].fsize; // file size
+						stbuf->st_mode = S_IFREG | 0666;
+						stbuf->st_nlink = 1; // file links
+					} else {
+						res = -ENOENT;
 					}
-					if (i != -1) { res = -ENOENT; }
 				} else { // We aren't looking for a file, just a directory...
 					stbuf->st_mode = S_IFDIR | 0755;
           stbuf->st_nlink = 2;
 				}
+				// Cached before unlocking so a write or mknod can't slip in between
+				attr_cache_put(path, res, stbuf);
+				unlock_directory(dirBlock);
 			}
-			free(root);
-			fclose(disk);
+			release_disk_block(dir);
+			pthread_rwlock_unlock(&root_lock);
 		}
 	}
-	printf("=======================\n");
+	// Writes still in a buffer count too, but aren't cached since they're not in the file yet
+	if (res == 0 && S_ISREG(stbuf->st_mode)) { add_pending_size(path, stbuf); }
 	return res;
 }
 
@@ -560,8 +1700,7 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
  */
 static int cs1550_mkdir(const char *path, mode_t mode)
 {
-	printf("=======================\n");
-	printf("mkdir() debug messages:\n");
+	LOG_DEBUG("mkdir(%s)", path);
 	(void) mode;
 	(void) path;
 	int res = 0;
@@ -575,30 +1714,40 @@ static int cs1550_mkdir(const char *path, mode_t mode)
 		return -ENAMETOOLONG;
 	}
 
-	FILE * disk = fopen(DISK_FILE_NAME, "rb+");
-	root_directory * root = get_root_directory(disk);
-	if (root->nDirectories >= MAX_DIRS_IN_ROOT) { // When the directories in the root are full
+	// Only mkdir changes the root, so it is the only one that needs it to itself
+	pthread_rwlock_wrlock(&root_lock);
+	root_directory * root = get_root_directory();
+	// Checked under the lock, so two racing mkdirs can't both add the name
+	if (index_find(0, new_directory, "", NULL, NULL) == 0) {
+		res = -EEXIST;
+		LOG_DEBUG("%s already exists", path);
+	} else if (root->nDirectories >= MAX_DIRS_IN_ROOT) { // When the directories in the root are full
     res = -ENOSPC;
   } else { // Otherwise go ahead and make a new directory in root
-		// Resave the root to the first block (0) in disk
 		int currDirNum = root->nDirectories;
-		long startBlock = find_open_block(disk);
+		long startBlock = find_open_block();
 		if (startBlock == -1) { // Means the disk is FULL!
 			res = -ENOSPC;
 		} else {
+			// Free blocks can hold anything left over from before a format
+			directory_entry * newDir = get_directory(startBlock);
+			memset(newDir, 0, BLOCK_SIZE);
+			write_to_disk((void *) newDir, startBlock);
+			release_disk_block(newDir);
 			// Give the new directory in the root a new name
 			strcpy(root->directories[currDirNum].dname, new_directory);
 			root->directories[currDirNum].nStartBlock = startBlock;
 			// Increase the number of directories
 			root->nDirectories++;
-			printf("WRITING ROOT TO DISK WITH NEW DIRECTORY\n");
+			LOG_DEBUG("Writing root to disk with new directory %s", new_directory);
 			// printf("New dir: name %s at block %d\n", root->directories[currDirNum].dname, root->directories[currDirNum].nStartBlock);
-			write_to_disk((void *) root, 0, disk);
+			write_to_disk((void *) root, geometry.nRootBlock);
+			res = index_add(0, new_directory, "", currDirNum, startBlock);
+			attr_cache_forget(path);
 		}
 	}
-	free(root);
-	fclose(disk);
-	printf("=======================\n");
+	release_disk_block(root);
+	pthread_rwlock_unlock(&root_lock);
 	return res;
 }
 
@@ -622,6 +1771,102 @@ static int cs1550_unlink(const char *path)
     return 0;
 }
 
+/*
+ * Called once when the filesystem is mounted. Opens the .disk image and maps
+ * the whole thing so the handlers never have to touch a FILE again.
+ */
+static void * cs1550_init(struct fuse_conn_info *conn)
+{
+	(void) conn;
+	struct stat st;
+	disk_fd = open(disk_path, O_RDWR);
+	if (disk_fd == -1 || fstat(disk_fd, &st) != 0) {
+		LOG_ERROR("ERROR: Could not open the disk %s", disk_path);
+		exit(1);
+	}
+	disk_length = st.st_size;
+	disk_map = mmap(NULL, disk_length, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+	if (disk_map == MAP_FAILED) {
+		LOG_ERROR("ERROR: Could not map the disk %s", disk_path);
+		exit(1);
+	}
+	if (load_geometry() != 0) {
+		LOG_ERROR("ERROR: %s is not a cs1550 image, format it with mkfs.cs1550 first", disk_path);
+		exit(1);
+	}
+	LOG_INFO("Mounted %ld blocks of %ld bytes", geometry.nBlocks, geometry.nBlockSize);
+	page_size = sysconf(_SC_PAGESIZE);
+	locks_init();
+	attr_cache_init();
+	if (cache_init(config.cacheBlocks) != 0) {
+		LOG_ERROR("ERROR: Could not allocate the block cache (cache_blocks=%d)", config.cacheBlocks);
+		exit(1);
+	}
+	if (bitmap_load() != 0) {
+		LOG_ERROR("ERROR: Could not load the free space bitmap");
+		exit(1);
+	}
+	if (index_build() != 0) {
+		LOG_ERROR("ERROR: Could not build the name index");
+		exit(1);
+	}
+	// Started last so the errors above are written before exit
+	log_start();
+	return NULL;
+}
+
+/*
+ * Called once on unmount. Waits for every dirty page to reach the .disk file
+ * before the mapping goes away.
+ */
+static void cs1550_destroy(void *private_data)
+{
+	(void) private_data;
+	open_paths_destroy();
+	cache_flush();
+	LOG_INFO("Block cache: %lu hits, %lu misses, %lu evictions, %lu writebacks, %lu waits",
+		cache.hits, cache.misses, cache.evictions, cache.writebacks, cache.waits);
+	index_destroy();
+	cache_destroy();
+	bitmap_destroy();
+	sync_disk(MS_SYNC);
+	munmap(disk_map, disk_length);
+	close(disk_fd);
+	disk_map = NULL;
+	disk_fd = -1;
+	log_stop();
+}
+
+/*
+ * Unlike flush, fsync has to wait until the data is actually on the .disk file
+ */
+static int cs1550_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void) datasync;
+
+	int res = commit_path(path);
+	flush_metadata();
+	int synced = sync_disk(MS_SYNC);
+	return res != 0 ? res : synced;
+}
+
+/*
+ * Reports block usage for df. The free count is kept current by the
+ * in-memory bitmap, so there is nothing to scan here.
+ */
+static int cs1550_statfs(const char *path, struct statvfs *stbuf)
+{
+	(void) path;
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = bitmap.nBlocks;
+	stbuf->f_bfree = __atomic_load_n(&bitmap.nFree, __ATOMIC_RELAXED);
+	stbuf->f_bavail = stbuf->f_bfree;
+	stbuf->f_namemax = MAX_FILENAME + 1 + MAX_EXTENSION;
+	return 0;
+}
+
 /******************************************************************************
  *
  *  DO NOT MODIFY ANYTHING BELOW THIS LINE
@@ -650,8 +1895,13 @@ static int cs1550_truncate(const char *path, off_t size)
  */
 static int cs1550_open(const char *path, struct fuse_file_info *fi)
 {
-	(void) path;
-	(void) fi;
+	// Somewhere to keep this handle's readahead state, and the path's write buffer
+	struct open_file * stream = calloc(1, sizeof(struct open_file));
+	if (stream == NULL) { return -ENOMEM; }
+	stream->file = open_path_get(path, 1);
+	if (stream->file == NULL) { free(stream); return -ENOMEM; }
+	pthread_mutex_init(&stream->lock, NULL);
+	fi->fh = (uintptr_t) stream;
     /*
         //if we can't find the desired file, return an error
         return -ENOENT;
@@ -676,13 +1926,40 @@ static int cs1550_open(const char *path, struct fuse_file_info *fi)
  */
 static int cs1550_flush (const char *path , struct fuse_file_info *fi)
 {
-	(void) path;
 	(void) fi;
-
-	return 0; //success!
+	// Buffered writes go into the file first, so close can report their errors
+	int res = commit_path(path);
+	// Push dirty cached blocks into the mapping and start writing it back,
+	// but don't wait on it (fsync does that)
+	flush_metadata();
+	int synced = sync_disk(MS_ASYNC);
+	return res != 0 ? res : synced;
 }
 
 
+/*
+ * Called once the last descriptor sharing this open is closed
+ */
+static int cs1550_release(const char *path, struct fuse_file_info *fi)
+{
+	struct open_file * stream = open_file_of(fi);
+	if (stream != NULL) {
+		// Normally flush got here first, this is for anything written since.
+		// If it fails the buffer outlives the handle (see open_path_put)
+		pthread_mutex_lock(&stream->file->lock);
+		int res = commit_writes(stream->file);
+		pthread_mutex_unlock(&stream->file->lock);
+		if (res != 0) {
+			LOG_ERROR("ERROR: Could not commit buffered writes to %s (%d), retrying at the next flush, fsync or unmount", path, res);
+		}
+		open_path_put(stream->file);
+		pthread_mutex_destroy(&stream->lock);
+		free(stream);
+		fi->fh = 0;
+	}
+	return 0;
+}
+
 //register our new functions as the implementations of the syscalls
 static struct fuse_operations hello_oper = {
     .getattr	= cs1550_getattr,
@@ -690,17 +1967,47 @@ static struct fuse_operations hello_oper = {
     .mkdir	= cs1550_mkdir,
 	.rmdir = cs1550_rmdir,
     .read	= cs1550_read,
+#if FUSE_VERSION >= 29
+	.read_buf	= cs1550_read_buf,
+#endif
     .write	= cs1550_write,
 	.mknod	= cs1550_mknod,
 	.unlink = cs1550_unlink,
 	.truncate = cs1550_truncate,
 	.flush = cs1550_flush,
+	.fsync = cs1550_fsync,
+	.statfs = cs1550_statfs,
 	.open	= cs1550_open,
+	.release = cs1550_release,
+	.init	= cs1550_init,
+	.destroy = cs1550_destroy,
+};
+
+// Seconds the kernel may cache lookups and attributes (and failed lookups)
+#define DEFAULT_TIMEOUT "5"
+
+// Filesystem specific mount options, everything else goes on to fuse_main
+static const struct fuse_opt cs1550_opts[] = {
+	{ "cache_blocks=%d", offsetof(struct cs1550_config, cacheBlocks), 0 },
+	{ "log_level=%d", offsetof(struct cs1550_config, logLevel), 0 },
+	FUSE_OPT_END
 };
 
 //Don't change this.
 int main(int argc, char *argv[])
 {
-	printf("test %d\n", 0);
-	return fuse_main(argc, argv, &hello_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (fuse_opt_parse(&args, &config, cs1550_opts, NULL) == -1) {
+		return 1;
+	}
+	// Every change to the filesystem goes through this mount, so the kernel
+	// can hold on to names, attributes and misses for a while. These come
+	// first so the same options given with -o on the command line win
+	fuse_opt_insert_arg(&args, 1, "-oentry_timeout=" DEFAULT_TIMEOUT ",attr_timeout=" DEFAULT_TIMEOUT ",negative_timeout=" DEFAULT_TIMEOUT);
+	// fuse_main may chdir("/") when it daemonizes, so pin down where .disk is first
+	if (realpath(DISK_FILE_NAME, disk_path) == NULL) {
+		LOG_ERROR("ERROR: Could not find the disk %s", DISK_FILE_NAME);
+		return 1;
+	}
+	return fuse_main(args.argc, args.argv, &hello_oper, NULL);
 }
@@ -0,0 +1,112 @@
+/*
+On-disk format of a cs1550 image, shared by the filesystem (cs1550.c) and
+the tools that build or check images (mkfs.cs1550.c).
+
+Block 0 holds the superblock, which records the geometry the image was
+formatted with. Nothing else about the layout is fixed: the root directory
+and the free space bitmap are wherever the superblock says they are.
+
+The block size is only known at run time, so the capacity macros below are
+written in terms of BLOCK_SIZE, which whoever includes this file defines
+(cs1550.c reads it from the mounted superblock).
+*/
+
+#ifndef CS1550_H
+#define CS1550_H
+
+#include <stddef.h>
+
+//we'll use 8.3 filenames
+#define	MAX_FILENAME 8
+#define	MAX_EXTENSION 3
+
+// "cs1550fs" read as a little-endian long
+#define CS1550_MAGIC 0x7366303535317363L
+#define CS1550_VERSION 1
+
+// Block sizes mkfs accepts: a power of two in this range
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE (1024 * 1024)
+#define DEFAULT_BLOCK_SIZE 4096
+
+struct cs1550_superblock
+{
+	long magic;			//CS1550_MAGIC, anything else isn't a formatted image
+	long version;		//CS1550_VERSION
+	long nBlockSize;	//Bytes per block
+	long nBlocks;		//Blocks in the image, including the superblock
+	long nBitmapStart;	//First block of the free space bitmap
+	long nBitmapBlocks;	//How many blocks the bitmap takes up, one bit per block
+	long nRootBlock;	//Where the root directory is
+} ;
+
+//How many files can there be in one directory?
+#define MAX_FILES_IN_DIR ((BLOCK_SIZE - sizeof(int)) / sizeof(struct cs1550_file_directory))
+
+//The attribute packed means to not align these things
+struct cs1550_directory_entry
+{
+	int nFiles;	//How many files are in this directory.
+				//Needs to be less than MAX_FILES_IN_DIR
+
+	struct cs1550_file_directory
+	{
+		char fname[MAX_FILENAME + 1];	//filename (plus space for nul)
+		char fext[MAX_EXTENSION + 1];	//extension (plus space for nul)
+		size_t fsize;					//file size
+		long nStartBlock;				//where the first block is on disk
+	} __attribute__((packed)) files[];	//There is an array of these, filling out the block
+} ;
+
+#define MAX_DIRS_IN_ROOT ((BLOCK_SIZE - sizeof(int)) / sizeof(struct cs1550_directory))
+
+struct cs1550_root_directory
+{
+	int nDirectories;	//How many subdirectories are in the root
+						//Needs to be less than MAX_DIRS_IN_ROOT
+	struct cs1550_directory
+	{
+		char dname[MAX_FILENAME + 1];	//directory name (plus space for nul)
+		long nStartBlock;				//where the directory block is on disk
+	} __attribute__((packed)) directories[];	//There is an array of these, filling out the block
+} ;
+
+//How many extents fit in one extent block?
+#define MAX_EXTENTS_IN_BLOCK ((BLOCK_SIZE - 2 * sizeof(long)) / sizeof(struct cs1550_extent))
+
+// A file's nStartBlock points at the first of a chain of these. Each extent
+// is a run of contiguous blocks on disk, so a large file is a handful of
+// extents no matter how many blocks it has. 0 means the file has no blocks
+// (block 0 is always the superblock).
+struct cs1550_extent_block
+{
+	long nExtents;		//How many extents in this block are used
+	long nNextBlock;	//Next extent block in the chain, 0 if this is the last one
+
+	struct cs1550_extent
+	{
+		long nFileBlock;	//First block of the file this extent covers
+		long nStartBlock;	//Where that block is on disk
+		long nBlocks;		//How many contiguous blocks are in the run
+	} __attribute__((packed)) extents[];
+} ;
+
+// typedef renames the directory to the second argument
+typedef struct cs1550_superblock superblock;
+typedef struct cs1550_directory_entry directory_entry;
+typedef struct cs1550_root_directory root_directory;
+typedef struct cs1550_extent_block extent_block;
+typedef struct cs1550_file_directory file_directory;
+
+// DATA BLOCK
+	// Superblock: always block 0
+	// Type 1: Root directory
+		// - Stored at nRootBlock (mkfs puts it right after the superblock)
+	// Type 2: Subdirectory (directory_entry)
+	// Type 3: File data, found through a chain of extent blocks
+		// - When type 2 or 3 created, check bitmap for a FREE (0) block
+		// - Then add it to the disk and set the bitmap to 1 for that block
+	// The bitmap: bit b of byte k is block k * 8 + b. The superblock, root
+		// and the bitmap's own blocks are always TAKEN (1)
+
+#endif
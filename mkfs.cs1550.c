@@ -0,0 +1,139 @@
+/*
+Formats a cs1550 disk image.
+
+COMPILE:
+gcc -o mkfs.cs1550 mkfs.cs1550.c
+
+RUN:
+./mkfs.cs1550 [-s size] [-b block_size] [-B start|end] .disk
+
+-s sets the image size (K, M and G suffixes work). Without it an existing
+image keeps its size and a new one is made 5M.
+-b is the block size, a power of two from 512 up to 1M (4096 by default).
+-B puts the free space bitmap right after the root directory (start, the
+default) or in the last blocks of the image (end).
+
+The superblock goes in block 0 and the root directory in block 1.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cs1550.h"
+
+#define DEFAULT_DISK_SIZE 5242880 // 5242880 Bytes = 5 MB
+
+// Parses sizes like 4096, 64K, 5M or 2G. Returns -1 if it isn't one
+static long parse_size(const char * text) {
+	char * end;
+	long size = strtol(text, &end, 10);
+	if (end == text || size <= 0) { return -1; }
+	switch (*end) {
+		case 'G': case 'g': size *= 1024;
+		/* fall through */
+		case 'M': case 'm': size *= 1024;
+		/* fall through */
+		case 'K': case 'k': size *= 1024; end++;
+		/* fall through */
+		case '\0': break;
+		default: return -1;
+	}
+	return *end == '\0' ? size : -1;
+}
+
+static int write_block(int fd, long blockSize, long blockNum, const void * block) {
+	if (pwrite(fd, block, blockSize, (off_t) blockNum * blockSize) != blockSize) { return -1; }
+	return 0;
+}
+
+// Lays out a fresh filesystem of nBlocks blocks on fd
+static int format_disk(int fd, long blockSize, long nBlocks, int bitmapAtEnd) {
+	superblock sb;
+	memset(&sb, 0, sizeof(sb));
+	sb.magic = CS1550_MAGIC;
+	sb.version = CS1550_VERSION;
+	sb.nBlockSize = blockSize;
+	sb.nBlocks = nBlocks;
+	sb.nRootBlock = 1;
+	sb.nBitmapBlocks = (nBlocks + blockSize * 8 - 1) / (blockSize * 8);
+	sb.nBitmapStart = bitmapAtEnd ? nBlocks - sb.nBitmapBlocks : sb.nRootBlock + 1;
+	if (sb.nBitmapStart <= sb.nRootBlock || sb.nBitmapStart + sb.nBitmapBlocks > nBlocks) { return -1; }
+
+	char * block = calloc(1, blockSize);
+	if (block == NULL) { return -1; }
+	int res = 0;
+	// An empty root directory is all zeroes
+	res |= write_block(fd, blockSize, sb.nRootBlock, block);
+	// Mark the superblock, root and bitmap taken, along with the bits past the last block
+	long i;
+	for (i = 0; i < sb.nBitmapBlocks && res == 0; i++) {
+		long first = i * blockSize * 8; // Block described by the first bit of this bitmap block
+		long b;
+		memset(block, 0, blockSize);
+		for (b = 0; b < blockSize * 8; b++) {
+			long blockNum = first + b;
+			if (blockNum == 0 || blockNum == sb.nRootBlock || blockNum >= nBlocks
+					|| (blockNum >= sb.nBitmapStart && blockNum < sb.nBitmapStart + sb.nBitmapBlocks)) {
+				block[b / 8] |= 1 << (b % 8);
+			}
+		}
+		res |= write_block(fd, blockSize, sb.nBitmapStart + i, block);
+	}
+	// Superblock last, so a format that fails partway never looks mountable
+	memset(block, 0, blockSize);
+	memcpy(block, &sb, sizeof(sb));
+	if (res == 0) { res = write_block(fd, blockSize, 0, block); }
+	free(block);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	long diskSize = -1;
+	long blockSize = DEFAULT_BLOCK_SIZE;
+	int bitmapAtEnd = 0;
+	int usage = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:b:B:")) != -1) {
+		switch (opt) {
+			case 's': diskSize = parse_size(optarg); usage |= diskSize == -1; break;
+			case 'b': blockSize = parse_size(optarg); break;
+			case 'B':
+				if (strcmp(optarg, "start") == 0) { bitmapAtEnd = 0; }
+				else if (strcmp(optarg, "end") == 0) { bitmapAtEnd = 1; }
+				else { usage = 1; }
+				break;
+			default: usage = 1;
+		}
+	}
+	if (usage || optind != argc - 1 || blockSize < MIN_BLOCK_SIZE
+			|| blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0) {
+		fprintf(stderr, "usage: %s [-s size] [-b block_size] [-B start|end] image\n", argv[0]);
+		return 1;
+	}
+	const char * path = argv[optind];
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "ERROR: Could not open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (diskSize == -1) { diskSize = st.st_size > 0 ? st.st_size : DEFAULT_DISK_SIZE; }
+	if (ftruncate(fd, diskSize) != 0) {
+		fprintf(stderr, "ERROR: Could not size %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	long nBlocks = diskSize / blockSize;
+	if (nBlocks < 4 || format_disk(fd, blockSize, nBlocks, bitmapAtEnd) != 0 || fsync(fd) != 0) {
+		fprintf(stderr, "ERROR: Could not format %s\n", path);
+		return 1;
+	}
+	close(fd);
+	printf("%s: %ld blocks of %ld bytes\n", path, nBlocks, blockSize);
+	return 0;
+}